@@ -9,6 +9,27 @@
 #include <sstream>
 #include <iomanip>
 #include <string>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <deque>
+#include <cstring>
+#include <array>
+#include <fstream>
+#include <filesystem>
+#include <tuple>
+#include <functional>
+#include <future>
+#include <random>
+#include <thread>
+#include <condition_variable>
+#include <cerrno>
+#include <sys/inotify.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
 
 struct DrugEntry { std::string name, category; double survival_rate; };
 
@@ -35,76 +56,1030 @@ static const std::vector<DrugEntry> DRUGS = {
     {"Control (None)",   "Negative control",      0.92},
 };
 
+struct Droplet { float x, y, r; int alive=0, dead=0; };
+
+struct DropletStats {
+    int count=0, empty=0, single=0, multi=0, unassigned=0;
+    double mean_viability=0, single_viability=0;   // over occupied / single-cell droplets
+};
+
+struct WellQC {
+    double focus=0, saturation=0, background=0, snr=0;
+    bool pass=true;
+    std::string reason;   // first failed check, empty when passing
+};
+
 struct WellResult {
     int well_index, total_cells, alive_cells, dead_cells;
     std::string drug_name, drug_category, frame_b64;
+    std::string overlay;   // vector overlay JSON when the client draws annotations itself
     double viability, efficacy;
+    WellQC qc;
+    DropletStats droplet_stats;
+    std::vector<Droplet> droplets;   // only kept when the per-droplet list is requested
 };
 
-cv::Mat generate_well_frame(double survival_rate, int width=320, int height=320) {
+// ring: disc mean minus the surrounding annulus mean; texture: disc intensity std.
+struct CellFeatures { float area, mean, max, circularity, ring, texture; };
+
+// Every detected cell of a run, stored column-wise so exports and downstream
+// consumers read each measurement as one contiguous array.
+struct CellTable {
+    std::vector<int32_t> well;
+    std::vector<float> x, y, area, mean, max, circularity, ring, texture;
+    std::vector<uint8_t> alive;   // filled by classify_cells()
+    size_t size() const { return x.size(); }
+    void append(int w, const cv::KeyPoint& kp, const CellFeatures& f) {
+        well.push_back(w); x.push_back(kp.pt.x); y.push_back(kp.pt.y);
+        area.push_back(f.area); mean.push_back(f.mean); max.push_back(f.max);
+        circularity.push_back(f.circularity); ring.push_back(f.ring);
+        texture.push_back(f.texture); alive.push_back(0);
+    }
+    void append(const CellTable& o) {
+        auto cat=[](auto& dst, const auto& src){ dst.insert(dst.end(),src.begin(),src.end()); };
+        cat(well,o.well); cat(x,o.x); cat(y,o.y); cat(area,o.area); cat(mean,o.mean); cat(max,o.max);
+        cat(circularity,o.circularity); cat(ring,o.ring); cat(texture,o.texture); cat(alive,o.alive);
+    }
+};
+
+// COCO-style RLE masks of one well's cells, in CellTable row order from first_cell.
+struct WellMasks {
+    int height=0, width=0, first_cell=0;
+    std::vector<std::string> rle;
+};
+
+// Per-well outcome kept after the response is sent (no images).
+struct WellSummary {
+    int well_index;
+    std::string drug, category;
+    double efficacy, viability;
+    bool qc_pass;
+};
+
+// Raw grayscale 1/4-resolution frame used for plate overviews.
+struct Thumb { int width=0, height=0; std::vector<uchar> px; };
+
+static const int FRAME_LEVELS = 3;   // full, 1/2, 1/4 resolution
+typedef std::array<std::vector<uchar>,FRAME_LEVELS> FramePyramid;   // PNG per level
+
+// Everything a finished run keeps for follow-up requests.
+struct RunRecord {
+    std::string id, patient, cohort;
+    int64_t timestamp=0;
+    int params_version=0;               // AnalyzerParams the run used
+    std::string summary;                // JSON served by /api/runs/{id}
+    std::vector<WellSummary> wells;
+    CellTable cells;
+    bool cells_kept=true;               // false: loaded from a store record without cell rows
+    std::vector<FramePyramid> frames;   // per well
+    std::vector<Thumb> thumbs;          // per well
+    std::vector<WellMasks> masks;   // empty unless masks were requested
+};
+
+struct SimCell { double cx, cy, r, z; int intensity; bool alive; };
+struct SimDroplet { double cx, cy, r; };
+
+enum Detector { DETECT_BLOB, DETECT_LOG };
+
+struct AnalysisOptions {
+    Detector detector=DETECT_BLOB;
+    int z_planes=1;      // >1: acquire a Z-stack per well and fuse it (EDF)
+    int droplets=0;      // 1: encapsulate cells in droplets and segment them, 2: also list each droplet
+    int frame_size=320;
+    int cell_count=0;    // 0: the default 25-39 cells per well
+    bool declump=false;  // split touching cells with a distance-transform watershed
+    bool flatfield=false; // simulate dark offset, vignetting and uneven background, then correct them
+    bool masks=false;    // keep run-length encoded cell masks for /api/runs/{id}/wells/{w}/masks
+    bool vector_overlay=false; // send the raw grayscale frame plus circles/labels instead of a rendered PNG
+    int frame_level=0;   // pyramid level inlined as frame_b64 (0 full, 1 half, 2 quarter)
+    bool logistic=false; // live/dead from the loaded logistic model instead of the mean threshold
+    std::string patient; // patient id the run is filed under in the run store
+    std::string cohort;  // cohort (e.g. indication) the run counts towards in /api/drugs
+    bool stream=false;   // send each well once analysed and keep no frames (low-memory mode)
+};
+
+static const double DEFOCUS_PX = 9.0;   // blur radius (px) per unit of |cell z - plane z|
+static const double DROPLET_LOAD = 1.0;  // Poisson mean cells per droplet ("Target: 1 cell / droplet")
+static const int    DROPLET_WALL_LEVEL = 8;          // oil walls image darker than any background pixel
+static const double DROPLET_MIN_R = 8, DROPLET_MAX_R = 80;
+static const double OPTICS_DARK = 6.0;          // simulated camera offset
+static const double OPTICS_VIGNETTE = 0.45;     // flat-field falloff at the frame corners
+static const double OPTICS_RAMP = 24.0;         // uneven illumination across the frame
+static const int    FLAT_TILE = 64, FLAT_SUB = 8;
+static const float  FLAT_BG_TARGET = 16.0f;     // background level the detector thresholds assume
+static const int    LOG_OCTAVES = 3, LOG_SCALES = 3;   // scales per octave
+static const double LOG_SIGMA0 = 2.0;           // finest scale: blobs of radius ~2 px
+static const float  LOG_THRESHOLD = 6.0f;       // scale-normalised response (half the blob amplitude)
+static const double LIVE_MEAN_THRESHOLD = 75.0; // mean disc intensity above which a cell is alive
+static const int    CLASSIFIER_FEATURES = 5;   // mean, max, area, ring, texture
+static const size_t RUN_CACHE_SIZE = 16;        // finished runs kept for /api/runs/{id}/...
+static const double QC_MIN_FOCUS = 0.008;       // foreground gradient/amplitude energy; one plane at |z|=1 is ~0.006
+static const double QC_FOCUS_FG_SIGMA = 6.0;    // foreground for the focus metric: this many noise sigma above background
+static const int    QC_FOCUS_MIN_PIXELS = 50;   // fewer foreground pixels than this: no measurable focus
+static const double QC_MAX_SATURATION = 0.05;   // fraction of pixels clipped at 255
+static const double QC_MAX_BACKGROUND = 100.0;
+static const double QC_MIN_SNR = 5.0;           // (p99 - background) / robust noise sigma
+
+// Simulation RNG, one per thread so wells can be generated concurrently (OpenCV's
+// theRNG() used by randn is per-thread as well); seed_sim() makes a frame reproducible.
+static thread_local std::minstd_rand SIM_RNG(std::random_device{}());
+
+int sim_rand() { return (int)(SIM_RNG()%((unsigned)RAND_MAX+1u)); }
+
+void seed_sim(unsigned seed) {
+    SIM_RNG.seed(seed);
+    cv::theRNG()=cv::RNG(seed);
+}
+
+cv::Mat background_frame(int width, int height) {
     cv::Mat frame(height, width, CV_8UC1, cv::Scalar(12));
     cv::Mat noise(height, width, CV_8UC1);
     cv::randn(noise, 4, 2);
     frame += noise;
-    int num_cells = 25 + std::rand() % 15;
+    return frame;
+}
+
+// Cell layout for one well. depth>0 scatters cells over focal heights in [-depth,depth].
+std::vector<SimCell> generate_cells(double survival_rate, int width, int height, double depth=0.0, int count=0) {
+    std::vector<SimCell> cells;
+    int num_cells = count>0 ? count : 25 + sim_rand() % 15;
     for (int i = 0; i < num_cells; i++) {
-        double cx = 20 + std::rand() % (width  - 40);
-        double cy = 20 + std::rand() % (height - 40);
-        double r  = 7  + std::rand() % 10;
-        bool alive = ((double)std::rand() / RAND_MAX) < survival_rate;
-        int intensity = alive ? (150 + std::rand() % 90) : (20 + std::rand() % 30);
-        double dr = alive ? r : r * 0.70;
-        for (int dy = -(int)dr-4; dy <= (int)dr+4; dy++) {
-            for (int dx = -(int)dr-4; dx <= (int)dr+4; dx++) {
-                int px=(int)cx+dx, py=(int)cy+dy;
+        SimCell c;
+        c.cx = 20 + sim_rand() % (width  - 40);
+        c.cy = 20 + sim_rand() % (height - 40);
+        c.r  = 7  + sim_rand() % 10;
+        c.alive = ((double)sim_rand() / RAND_MAX) < survival_rate;
+        c.intensity = c.alive ? (150 + sim_rand() % 90) : (20 + sim_rand() % 30);
+        c.z = depth>0 ? depth*(2.0*sim_rand()/RAND_MAX-1.0) : 0.0;
+        cells.push_back(c);
+    }
+    return cells;
+}
+
+// Hex-packed emulsion filling the frame, radii 18-22 px.
+std::vector<SimDroplet> generate_droplets(int width, int height) {
+    std::vector<SimDroplet> drops;
+    double pitch=2*22+4, row_h=pitch*0.866;
+    for (int row=0; 24+row*row_h < height-24; row++) {
+        for (double x=24+(row%2)*pitch/2; x < width-24; x+=pitch)
+            drops.push_back({x, 24+row*row_h, 18.0+sim_rand()%5});
+    }
+    return drops;
+}
+
+// Poisson-loads each droplet with cells small enough to sit inside it.
+std::vector<SimCell> load_droplets(const std::vector<SimDroplet>& drops, double survival_rate, double depth=0.0) {
+    std::vector<SimCell> cells;
+    double L=std::exp(-DROPLET_LOAD);
+    for (const auto& d : drops) {
+        int k=0;
+        for (double p=(double)sim_rand()/RAND_MAX; p>L; p*=(double)sim_rand()/RAND_MAX) k++;
+        for (int i=0;i<k;i++) {
+            SimCell c;
+            c.r = 5 + sim_rand() % 4;
+            double a=2*CV_PI*sim_rand()/RAND_MAX, off=(d.r-c.r-3)*std::sqrt((double)sim_rand()/RAND_MAX);
+            c.cx = d.cx + off*std::cos(a);
+            c.cy = d.cy + off*std::sin(a);
+            c.alive = ((double)sim_rand() / RAND_MAX) < survival_rate;
+            c.intensity = c.alive ? (150 + sim_rand() % 90) : (20 + sim_rand() % 30);
+            c.z = depth>0 ? depth*(2.0*sim_rand()/RAND_MAX-1.0) : 0.0;
+            cells.push_back(c);
+        }
+    }
+    return cells;
+}
+
+void render_droplets(cv::Mat& frame, const std::vector<SimDroplet>& drops) {
+    for (const auto& d : drops)
+        cv::circle(frame, cv::Point((int)d.cx,(int)d.cy), (int)d.r, cv::Scalar(3), 2);
+}
+
+// Adds the cells to frame as seen from focal plane focus_z: out-of-focus cells
+// spread their (conserved) energy over a wider, dimmer disc.
+void render_cells(cv::Mat& frame, const std::vector<SimCell>& cells, double focus_z=0.0) {
+    int width=frame.cols, height=frame.rows;
+    for (const auto& c : cells) {
+        double dr = c.alive ? c.r : c.r * 0.70;
+        double blur = DEFOCUS_PX * std::abs(c.z - focus_z);
+        double sigma = std::sqrt(dr*dr + blur*blur);
+        double peak = c.intensity * (dr*dr) / (sigma*sigma);
+        int ext = (int)(sigma + 4 + blur);
+        for (int dy = -ext; dy <= ext; dy++) {
+            for (int dx = -ext; dx <= ext; dx++) {
+                int px=(int)c.cx+dx, py=(int)c.cy+dy;
                 if (px<0||px>=width||py<0||py>=height) continue;
                 double dist=std::sqrt(dx*dx+dy*dy);
-                if (dist>dr+4) continue;
-                double falloff=std::exp(-0.5*std::pow(dist/dr,2));
-                int val=std::min(255,(int)(frame.at<uchar>(py,px)+intensity*falloff));
+                if (dist>ext) continue;
+                double falloff=std::exp(-0.5*std::pow(dist/sigma,2));
+                int val=std::min(255,(int)(frame.at<uchar>(py,px)+peak*falloff));
                 frame.at<uchar>(py,px)=(uchar)val;
             }
         }
     }
+}
+
+cv::Mat generate_well_frame(double survival_rate, int width=320, int height=320) {
+    cv::Mat frame=background_frame(width, height);
+    render_cells(frame, generate_cells(survival_rate, width, height));
     return frame;
 }
 
-std::vector<cv::KeyPoint> detect_blobs(const cv::Mat& frame) {
+static double vignette(int x, int y, int width, int height) {
+    double dx=(x-width/2.0)/(width/2.0), dy=(y-height/2.0)/(height/2.0);
+    return 1.0-OPTICS_VIGNETTE*(dx*dx+dy*dy)/2.0;
+}
+
+// What the camera actually records: dark offset + flat-field response x
+// (scene + an illumination gradient).
+void apply_optics(cv::Mat& frame) {
+    for (int y=0;y<frame.rows;y++) {
+        uchar* p=frame.ptr<uchar>(y);
+        for (int x=0;x<frame.cols;x++) {
+            double lit=p[x]+OPTICS_RAMP*(x+y)/(frame.cols+frame.rows);
+            p[x]=(uchar)std::min(255.0,OPTICS_DARK+vignette(x,y,frame.cols,frame.rows)*lit+0.5);
+        }
+    }
+}
+
+// Dark frame (CV_8U) and per-pixel gain = 1/flat (CV_32F, flat normalised to unit mean).
+struct Calibration { cv::Mat dark, gain; };
+
+// Calibration frames are read once per frame size (CALIB_DARK / CALIB_FLAT
+// image paths, else the simulated optics) and shared by every well and run.
+std::shared_ptr<const Calibration> load_calibration(int width, int height) {
+    static std::mutex mu;
+    static std::map<std::pair<int,int>,std::shared_ptr<const Calibration>> cache;
+    std::lock_guard<std::mutex> lock(mu);
+    auto& slot=cache[{width,height}];
+    if (slot) return slot;
+    auto cal=std::make_shared<Calibration>();
+    cv::Size sz(width,height);
+    const char* dark_path=std::getenv("CALIB_DARK");
+    const char* flat_path=std::getenv("CALIB_FLAT");
+    if (dark_path) cal->dark=cv::imread(dark_path,cv::IMREAD_GRAYSCALE);
+    if (cal->dark.empty()) cal->dark=cv::Mat(sz,CV_8UC1,cv::Scalar(OPTICS_DARK));
+    else if (cal->dark.size()!=sz) cv::resize(cal->dark,cal->dark,sz,0,0,cv::INTER_AREA);
+    cv::Mat flat;
+    if (flat_path) {
+        cv::Mat raw=cv::imread(flat_path,cv::IMREAD_GRAYSCALE);
+        if (!raw.empty()) {
+            if (raw.size()!=sz) cv::resize(raw,raw,sz,0,0,cv::INTER_AREA);
+            cv::subtract(raw,cal->dark,flat,cv::Mat(),CV_32F);
+            flat*=1.0/std::max(1e-3,cv::mean(flat)[0]);
+        }
+    }
+    if (flat.empty()) {
+        flat.create(sz,CV_32FC1);
+        for (int y=0;y<height;y++)
+            for (int x=0;x<width;x++) flat.at<float>(y,x)=(float)vignette(x,y,width,height);
+    }
+    cv::max(flat,0.05,flat);
+    cal->gain.create(sz,CV_32FC1);
+    for (int y=0;y<height;y++) {
+        const float* f=flat.ptr<float>(y);
+        float* g=cal->gain.ptr<float>(y);
+        for (int x=0;x<width;x++) g[x]=1.0f/f[x];
+    }
+    std::cout<<"[Calib] "<<width<<"x"<<height<<(dark_path||flat_path?" from files":" simulated")<<std::endl;
+    slot=cal;
+    return slot;
+}
+
+// Dark subtraction, flat-field division, background removal and
+// renormalisation in one sweep. The background of each 64x64 tile is the
+// darkest 8x8 block mean in it (cells never fill a tile), bilinearly
+// interpolated between tile centres. Each tile row is estimated and then
+// corrected while it is still in cache, so every input is streamed from
+// memory once and the inner loops are plain float arithmetic that the
+// compiler vectorises.
+cv::Mat correct_frame(const cv::Mat& raw, const Calibration& cal) {
+    const int W=raw.cols, H=raw.rows, T=FLAT_TILE, S=FLAT_SUB;
+    const int gw=(W+T-1)/T, gh=(H+T-1)/T, sw=(W+S-1)/S;
+    cv::Mat out(H,W,CV_8UC1);
+    std::vector<float> grid(gw*gh,1e30f), row(W), bgrow(W), blocks(sw);
+    std::vector<int> x0(W), x1(W);
+    std::vector<float> fx(W);
+    for (int x=0;x<W;x++) {
+        double g=std::min<double>(gw-1,std::max(0.0,(x-T/2.0)/T));
+        x0[x]=(int)g; fx[x]=(float)(g-x0[x]); x1[x]=fx[x]>0?std::min(gw-1,x0[x]+1):x0[x];
+    }
+    auto corrected=[&](int y) {
+        const uchar* r=raw.ptr<uchar>(y);
+        const uchar* d=cal.dark.ptr<uchar>(y);
+        const float* g=cal.gain.ptr<float>(y);
+        float* o=row.data();
+        for (int x=0;x<W;x++) o[x]=(float)(r[x]-d[x])*g[x];
+    };
+    int next=0;
+    for (int ty=0;ty<gh;ty++) {
+        int y0=ty*T, y1=std::min(H,y0+T);
+        for (int by=y0;by<y1;by+=S) {
+            int ye=std::min(y1,by+S);
+            std::fill(blocks.begin(),blocks.end(),0.0f);
+            for (int y=by;y<ye;y++) {
+                corrected(y);
+                for (int b=0;b<sw;b++) {
+                    float acc=0;
+                    for (int x=b*S;x<std::min(W,b*S+S);x++) acc+=row[x];
+                    blocks[b]+=acc;
+                }
+            }
+            for (int b=0;b<sw;b++) {
+                float mean=blocks[b]/((std::min(W,b*S+S)-b*S)*(ye-by));
+                float& g=grid[ty*gw+b*S/T];
+                g=std::min(g,mean);
+            }
+        }
+        // Rows whose interpolation only needs tile rows <= ty can be emitted now.
+        int yend=ty==gh-1?H:std::min(H,y0+T/2);
+        for (;next<yend;next++) {
+            double gy=std::min<double>(gh-1,std::max(0.0,(next-T/2.0)/T));
+            int t0=(int)gy; float fy=(float)(gy-t0);
+            const float* g0=&grid[t0*gw];
+            const float* g1=&grid[(fy>0?std::min(gh-1,t0+1):t0)*gw];
+            for (int x=0;x<W;x++) {
+                float a=g0[x0[x]]+(g0[x1[x]]-g0[x0[x]])*fx[x];
+                float b=g1[x0[x]]+(g1[x1[x]]-g1[x0[x]])*fx[x];
+                bgrow[x]=a+(b-a)*fy;
+            }
+            corrected(next);
+            uchar* o=out.ptr<uchar>(next);
+            for (int x=0;x<W;x++) {
+                float v=row[x]-bgrow[x]+FLAT_BG_TARGET;
+                v=std::min(255.0f,std::max(0.0f,v));
+                o[x]=(uchar)(v+0.5f);
+            }
+        }
+    }
+    return out;
+}
+
+// Extended-depth-of-field fusion. Planes are added one at a time and each output
+// pixel keeps the plane with the highest local focus energy (box-summed
+// |Laplacian|), so memory is a fixed handful of frame-sized buffers whatever the
+// stack depth. Every step is an OpenCV vectorised primitive.
+class FocusStack {
+    cv::Mat fused, best, lap, energy, mask;
+public:
+    void add(const cv::Mat& plane) {
+        cv::Laplacian(plane, lap, CV_16S, 3);
+        cv::convertScaleAbs(lap, mask);
+        cv::boxFilter(mask, energy, CV_16U, cv::Size(9,9), cv::Point(-1,-1), false);
+        if (fused.empty()) { plane.copyTo(fused); energy.copyTo(best); return; }
+        cv::compare(energy, best, mask, cv::CMP_GT);
+        plane.copyTo(fused, mask);
+        energy.copyTo(best, mask);
+    }
+    const cv::Mat& result() const { return fused; }
+};
+
+// Image of one well as handed to detection: a single plane, or the all-in-focus
+// fusion of a Z-stack whose planes are rendered and discarded one by one.
+cv::Mat acquire_well(double survival_rate, const AnalysisOptions& opt) {
+    int width=opt.frame_size, height=opt.frame_size;
+    double depth=opt.z_planes>1?1.0:0.0;
+    std::vector<SimDroplet> drops;
+    std::vector<SimCell> cells;
+    if (opt.droplets) { drops=generate_droplets(width, height); cells=load_droplets(drops, survival_rate, depth); }
+    else cells=generate_cells(survival_rate, width, height, depth, opt.cell_count);
+    auto plane_at=[&](double z) {
+        cv::Mat plane=background_frame(width, height);
+        render_cells(plane, cells, z);
+        render_droplets(plane, drops);   // walls drawn last so no cell halo breaches them
+        if (opt.flatfield) apply_optics(plane);
+        return plane;
+    };
+    if (opt.z_planes<=1) return plane_at(0.0);
+    FocusStack stack;
+    for (int z=0;z<opt.z_planes;z++) stack.add(plane_at(-1.0+2.0*z/(opt.z_planes-1)));
+    return stack.result();
+}
+
+// Built-in blob detector settings; ANALYZER_CONFIG can override them at run time.
+cv::SimpleBlobDetector::Params default_blob_params() {
     cv::SimpleBlobDetector::Params p;
     p.filterByColor=true; p.blobColor=255;
     p.filterByArea=true; p.minArea=30; p.maxArea=3000;
     p.filterByCircularity=true; p.minCircularity=0.3;
     p.filterByConvexity=true; p.minConvexity=0.5;
     p.minThreshold=25; p.maxThreshold=220; p.thresholdStep=10;
+    return p;
+}
+
+std::vector<cv::KeyPoint> detect_blobs(const cv::Mat& frame,
+                                       const cv::SimpleBlobDetector::Params& p=default_blob_params()) {
     auto det=cv::SimpleBlobDetector::create(p);
     std::vector<cv::KeyPoint> kps;
     det->detect(frame,kps);
     return kps;
 }
 
-bool classify_blob(const cv::Mat& frame, const cv::KeyPoint& kp) {
-    cv::Mat mask=cv::Mat::zeros(frame.size(),CV_8UC1);
-    cv::circle(mask,cv::Point((int)kp.pt.x,(int)kp.pt.y),std::max(3,(int)(kp.size/2)),255,-1);
-    return cv::mean(frame,mask)[0]>75.0;
+// Scale-space Laplacian-of-Gaussian detector (accuracy tier). Each octave of
+// an area-downsampled pyramid is blurred incrementally with separable
+// Gaussians and filtered with the 3x3 Laplacian; -sigma^2 * LoG peaks at half
+// the amplitude of a bright Gaussian blob whose radius (std) is sigma. Maxima are kept
+// over their 3x3x3 scale-space neighbourhood, then overlapping detections
+// from adjacent octaves are suppressed in favour of the stronger one.
+std::vector<cv::KeyPoint> detect_log(const cv::Mat& frame) {
+    std::vector<cv::KeyPoint> found;
+    const int levels=LOG_SCALES+2;
+    cv::Mat base, blurred, lap, peak;
+    std::vector<cv::Mat> resp(levels), dil(levels);
+    frame.convertTo(base, CV_32F);
+    for (int o=0;o<LOG_OCTAVES;o++) {
+        if (o>0) cv::resize(base, base, cv::Size(), 0.5, 0.5, cv::INTER_AREA);
+        if (base.cols<16||base.rows<16) break;
+        double prev=0.5, scale=(double)(1<<o);
+        std::vector<double> sig(levels);
+        for (int i=0;i<levels;i++) {
+            sig[i]=LOG_SIGMA0*std::pow(2.0,(i-1.0)/LOG_SCALES);
+            cv::GaussianBlur(i?blurred:base, blurred, cv::Size(0,0), std::sqrt(sig[i]*sig[i]-prev*prev));
+            prev=sig[i];
+            cv::Laplacian(blurred, resp[i], CV_32F, 1, -sig[i]*sig[i]);
+            cv::dilate(resp[i], dil[i], cv::Mat());
+        }
+        for (int i=1;i<=LOG_SCALES;i++) {
+            cv::max(dil[i-1], dil[i+1], peak);
+            cv::max(peak, dil[i], peak);
+            for (int y=1;y<resp[i].rows-1;y++) {
+                const float* r=resp[i].ptr<float>(y);
+                const float* m=peak.ptr<float>(y);
+                for (int x=1;x<resp[i].cols-1;x++) {
+                    if (r[x]<LOG_THRESHOLD || r[x]<m[x]) continue;
+                    found.emplace_back((float)((x+0.5)*scale-0.5), (float)((y+0.5)*scale-0.5),
+                                       (float)(2*sig[i]*scale), -1.0f, r[x], o);
+                }
+            }
+        }
+    }
+    std::sort(found.begin(), found.end(), [](const cv::KeyPoint& a, const cv::KeyPoint& b){ return a.response>b.response; });
+    std::vector<cv::KeyPoint> kps;
+    for (const auto& k : found) {
+        bool dup=false;
+        for (const auto& q : kps) {
+            float dx=k.pt.x-q.pt.x, dy=k.pt.y-q.pt.y, rr=0.5f*std::max(k.size,q.size);
+            if (dx*dx+dy*dy<rr*rr) { dup=true; break; }
+        }
+        if (!dup) kps.push_back(k);
+    }
+    return kps;
+}
+
+// Features of one detected cell from two passes over its ROI only. The disc
+// of radius R gives mean, max, texture (intensity s.d.) and the area and
+// circularity of the half-maximum footprint; the annulus out to 1.5R gives
+// the local background that the ring contrast is taken against.
+// Circularity is 4*pi*A/P^2 with P the crack (pixel-edge) length scaled by
+// pi/4, which makes a digital disc come out close to 1.
+CellFeatures measure_cell(const cv::Mat& frame, const cv::KeyPoint& kp) {
+    int cx=(int)kp.pt.x, cy=(int)kp.pt.y, R=std::max(3,(int)(kp.size/2));
+    int Ro=std::max(R+2,R*3/2);
+    int x0=std::max(0,cx-Ro), x1=std::min(frame.cols-1,cx+Ro);
+    int y0=std::max(0,cy-Ro), y1=std::min(frame.rows-1,cy+Ro);
+    auto in_disc=[&](int x, int y){ return (x-cx)*(x-cx)+(y-cy)*(y-cy)<=R*R; };
+    int n=0, nring=0, lo=255, hi=0;
+    long sum=0, sumsq=0, ring=0;
+    for (int y=y0;y<=y1;y++) {
+        const uchar* p=frame.ptr<uchar>(y);
+        for (int x=x0;x<=x1;x++) {
+            int d2=(x-cx)*(x-cx)+(y-cy)*(y-cy), v=p[x];
+            if (d2>Ro*Ro) continue;
+            if (d2>R*R) { ring+=v; nring++; continue; }
+            sum+=v; sumsq+=v*v; n++; lo=std::min(lo,v); hi=std::max(hi,v);
+        }
+    }
+    CellFeatures f{0,0,0,0,0,0};
+    if (!n) return f;
+    f.mean=(float)sum/n; f.max=(float)hi;
+    f.ring=nring?f.mean-(float)ring/nring:0.0f;
+    f.texture=(float)std::sqrt(std::max(0.0,(double)sumsq/n-(double)f.mean*f.mean));
+    int level=lo+(hi-lo+1)/2;
+    auto inside=[&](int x, int y){
+        return x>=x0 && x<=x1 && y>=y0 && y<=y1 && in_disc(x,y) && frame.ptr<uchar>(y)[x]>=level;
+    };
+    int area=0, crack=0;
+    for (int y=std::max(0,cy-R);y<=std::min(frame.rows-1,cy+R);y++)
+        for (int x=std::max(0,cx-R);x<=std::min(frame.cols-1,cx+R);x++) {
+            if (!inside(x,y)) continue;
+            area++;
+            crack+=!inside(x-1,y)+!inside(x+1,y)+!inside(x,y-1)+!inside(x,y+1);
+        }
+    f.area=(float)area;
+    if (crack) f.circularity=(float)std::min(1.0,64.0*area/(CV_PI*crack*crack));
+    return f;
+}
+
+bool classify_blob(const cv::Mat& frame, const cv::KeyPoint& kp, double threshold=LIVE_MEAN_THRESHOLD) {
+    return measure_cell(frame,kp).mean>threshold;
+}
+
+// Logistic live/dead model over CLASSIFIER_FEATURES standardised features.
+// Text file, one row per keyword, features in CellTable order
+// (mean, max, area, ring, texture):
+//   mu <5 values>      sd <5 values>      w <5 values>      b <value>
+// w and b are required, mu and sd default to 0 and 1; a short or
+// non-numeric row or a non-positive sd rejects the file. On load the
+// standardisation is folded into w and b so inference is one multiply-add
+// per feature on the raw columns.
+struct LogisticModel {
+    bool loaded=false;
+    float w[CLASSIFIER_FEATURES]={}, bias=0;
+};
+
+bool load_model(const std::string& path, LogisticModel& m) {
+    std::ifstream in(path);
+    if (!in) return false;
+    double mu[CLASSIFIER_FEATURES]={}, sd[CLASSIFIER_FEATURES], w[CLASSIFIER_FEATURES]={}, b=0;
+    std::fill(sd,sd+CLASSIFIER_FEATURES,1.0);
+    bool has_w=false, has_b=false;
+    std::string key;
+    while (in>>key) {
+        double* row=key=="mu"?mu:key=="sd"?sd:key=="w"?w:nullptr;
+        if (row) for (int f=0;f<CLASSIFIER_FEATURES;f++) in>>row[f];
+        else if (key=="b") in>>b;
+        else { std::getline(in,key); continue; }   // comment or unknown row
+        if (!in) return false;                    // short or non-numeric row
+        has_w|=row==w; has_b|=!row;
+    }
+    if (in.bad() || !has_w || !has_b) return false;
+    for (int f=0;f<CLASSIFIER_FEATURES;f++)
+        if (!std::isfinite(sd[f]) || sd[f]<=0) return false;
+    m.bias=(float)b;
+    for (int f=0;f<CLASSIFIER_FEATURES;f++) {
+        m.w[f]=(float)(w[f]/sd[f]);
+        m.bias-=(float)(w[f]*mu[f]/sd[f]);
+    }
+    m.loaded=true;
+    return true;
+}
+
+// Detector and classifier tunables. A set is immutable once published:
+// ANALYZER_CONFIG edits build a new one with the next version and swap the
+// shared pointer atomically (RCU), so a run that took a snapshot finishes on
+// it while the next run picks up the new set.
+struct AnalyzerParams {
+    int version=1;
+    cv::SimpleBlobDetector::Params blob=default_blob_params();
+    double live_mean_threshold=LIVE_MEAN_THRESHOLD;
+    std::string model_path;   // logistic live/dead model, CLASSIFIER_MODEL unless the config names one
+    LogisticModel model;
+};
+
+static std::shared_ptr<const AnalyzerParams> PARAMS=std::make_shared<AnalyzerParams>();
+
+std::shared_ptr<const AnalyzerParams> current_params() { return std::atomic_load(&PARAMS); }
+
+// Config file, one "key = value" per line (spaces around '=' optional), '#'
+// comments; keys left out keep their built-in value:
+//   blob.min_threshold  blob.max_threshold  blob.threshold_step  blob.min_dist
+//   blob.min_area  blob.max_area  blob.min_circularity  blob.min_convexity  blob.min_inertia
+//   blob.filter_by_area  blob.filter_by_circularity  blob.filter_by_convexity  blob.filter_by_inertia (0/1)
+//   live_mean_threshold  classifier_model (path)
+// Returns nullptr, after saying why, on an unreadable file, a bad line or
+// inconsistent values.
+std::shared_ptr<AnalyzerParams> load_params(const std::string& path) {
+    typedef cv::SimpleBlobDetector::Params BP;
+    static const std::pair<const char*,float BP::*> reals[]={
+        {"blob.min_threshold",&BP::minThreshold}, {"blob.max_threshold",&BP::maxThreshold},
+        {"blob.threshold_step",&BP::thresholdStep}, {"blob.min_dist",&BP::minDistBetweenBlobs},
+        {"blob.min_area",&BP::minArea}, {"blob.max_area",&BP::maxArea},
+        {"blob.min_circularity",&BP::minCircularity}, {"blob.min_convexity",&BP::minConvexity},
+        {"blob.min_inertia",&BP::minInertiaRatio},
+    };
+    static const std::pair<const char*,bool BP::*> flags[]={
+        {"blob.filter_by_area",&BP::filterByArea}, {"blob.filter_by_circularity",&BP::filterByCircularity},
+        {"blob.filter_by_convexity",&BP::filterByConvexity}, {"blob.filter_by_inertia",&BP::filterByInertia},
+    };
+    auto p=std::make_shared<AnalyzerParams>();
+    if (const char* model=std::getenv("CLASSIFIER_MODEL")) p->model_path=model;
+    if (!path.empty()) {
+        std::ifstream in(path);
+        if (!in) { std::cerr<<"cannot read parameters "<<path<<std::endl; return nullptr; }
+        auto trim=[](std::string t){
+            const char* ws=" \t\r";
+            t.erase(0,t.find_first_not_of(ws)); t.erase(t.find_last_not_of(ws)+1);
+            return t;
+        };
+        std::string line;
+        for (int n=1;std::getline(in,line);n++) {
+            std::string body=trim(line.substr(0,line.find('#')));
+            if (body.empty()) continue;
+            size_t eq=body.find('=');
+            std::string key=trim(body.substr(0,eq)), val=eq==std::string::npos?"":trim(body.substr(eq+1));
+            bool ok=!key.empty() && !val.empty();
+            char* end=nullptr;
+            double v=ok?std::strtod(val.c_str(),&end):0;
+            bool number=ok && *end=='\0';
+            if (ok && key=="classifier_model") p->model_path=val;
+            else if (number && key=="live_mean_threshold") p->live_mean_threshold=v;
+            else {
+                ok=false;
+                for (const auto& r:reals) if (number && key==r.first) { p->blob.*r.second=(float)v; ok=true; }
+                for (const auto& f:flags) if (number && key==f.first) { p->blob.*f.second=v!=0; ok=true; }
+            }
+            if (!ok) { std::cerr<<path<<":"<<n<<": bad parameter line: "<<line<<std::endl; return nullptr; }
+        }
+    }
+    const auto& b=p->blob;
+    if (b.thresholdStep<=0 || b.minThreshold>=b.maxThreshold || b.minArea>b.maxArea) {
+        std::cerr<<path<<": inconsistent blob thresholds or areas"<<std::endl;
+        return nullptr;
+    }
+    if (!p->model_path.empty() && !load_model(p->model_path,p->model))
+        std::cerr<<"cannot read classifier model "<<p->model_path<<", using the mean threshold"<<std::endl;
+    return p;
+}
+
+// Reloads the config whenever it is rewritten or replaced. Editors swap the
+// file by rename, so the directory is watched and events are filtered by
+// name; a Kubernetes ConfigMap mount instead renames its "..data" symlink
+// over the new version, so that name counts as well. A file that fails to
+// load leaves the current set in place.
+void watch_params(const std::string& path) {
+    std::filesystem::path file(path);
+    std::string dir=file.has_parent_path()?file.parent_path().string():".", name=file.filename().string();
+    int fd=inotify_init1(IN_CLOEXEC);
+    if (fd<0 || inotify_add_watch(fd,dir.c_str(),IN_CLOSE_WRITE|IN_MOVED_TO)<0) {
+        std::cerr<<"cannot watch "<<path<<" ("<<std::strerror(errno)<<"), parameters stay fixed"<<std::endl;
+        if (fd>=0) close(fd);
+        return;
+    }
+    std::thread([fd,path,name]{
+        alignas(inotify_event) char buf[4096];
+        for (;;) {
+            ssize_t len=read(fd,buf,sizeof(buf));
+            if (len<0 && errno==EINTR) continue;
+            if (len<=0) break;
+            bool hit=false;
+            for (char* q=buf;q<buf+len;) {
+                const auto* ev=(const inotify_event*)q;
+                if (ev->len && (name==ev->name || std::strcmp(ev->name,"..data")==0)) hit=true;
+                q+=sizeof(inotify_event)+ev->len;
+            }
+            if (!hit) continue;
+            auto next=load_params(path);
+            if (!next) { std::cerr<<"keeping parameters v"<<current_params()->version<<std::endl; continue; }
+            next->version=current_params()->version+1;
+            std::atomic_store(&PARAMS,std::shared_ptr<const AnalyzerParams>(std::move(next)));
+            std::cout<<"Parameters v"<<current_params()->version<<" loaded from "<<path<<std::endl;
+        }
+        close(fd);
+    }).detach();
 }
 
-cv::Mat annotate_well(const cv::Mat& gray, const std::vector<cv::KeyPoint>& kps,
+// Live/dead calls for table rows [first, size) in one batched pass. Each
+// feature is a single multiply-add over a contiguous column, so the loops
+// vectorise; the sign of the logit is the decision (p > 0.5), no exp needed.
+// Without a model the mean threshold is applied the same way.
+void classify_cells(CellTable& t, size_t first, const LogisticModel* m, float threshold=LIVE_MEAN_THRESHOLD) {
+    size_t n=t.size()-first;
+    uint8_t* alive=t.alive.data()+first;
+    if (!m || !m->loaded) {
+        const float* mean=t.mean.data()+first;
+        for (size_t i=0;i<n;i++) alive[i]=mean[i]>threshold;
+        return;
+    }
+    const float* cols[CLASSIFIER_FEATURES]={
+        t.mean.data()+first, t.max.data()+first, t.area.data()+first,
+        t.ring.data()+first, t.texture.data()+first};
+    std::vector<float> z(n,m->bias);
+    for (int f=0;f<CLASSIFIER_FEATURES;f++) {
+        const float* x=cols[f];
+        float w=m->w[f];
+        for (size_t i=0;i<n;i++) z[i]+=w*x[i];
+    }
+    for (size_t i=0;i<n;i++) alive[i]=z[i]>0.0f;
+}
+
+static int hist_percentile(const uint32_t* hist, uint64_t n, double q) {
+    uint64_t target=(uint64_t)(q*n), acc=0;
+    for (int v=0;v<256;v++) { acc+=hist[v]; if (acc>target) return v; }
+    return 255;
+}
+
+// Image-quality metrics. One pass over the frame histograms the raw pixels
+// into four interleaved sub-histograms (so runs of equal pixels do not
+// serialise on one counter) and the magnitude of the 4-neighbour Laplacian,
+// whose median gives the pixel noise. Background (median), noise (MAD),
+// signal (p99) and saturation are read off the pixel histogram. Focus is
+// taken on a sigma=1 smoothed copy, so it is not dominated by sensor noise,
+// over the foreground only (6 noise sigma above background): the mean squared
+// gradient divided by the mean squared amplitude, i.e. ~1/(2 s^2) for a blob
+// of edge width s. It does not depend on brightness or on how many cells are
+// in the well; an empty well has no foreground and reports focus 0.
+WellQC measure_quality(const cv::Mat& frame) {
+    uint32_t sub[4][256]={}, lap[1024]={};
+    const int W=frame.cols, H=frame.rows;
+    for (int y=0;y<H;y++) {
+        const uchar* r=frame.ptr<uchar>(y);
+        if (y>0 && y<H-1) {
+            const uchar* up=frame.ptr<uchar>(y-1);
+            const uchar* dn=frame.ptr<uchar>(y+1);
+            for (int x=1;x<W-1;x++)
+                lap[std::min(1023,std::abs(4*r[x]-r[x-1]-r[x+1]-up[x]-dn[x]))]++;
+        }
+        int x=0;
+        for (;x+4<=W;x+=4) { sub[0][r[x]]++; sub[1][r[x+1]]++; sub[2][r[x+2]]++; sub[3][r[x+3]]++; }
+        for (;x<W;x++) sub[0][r[x]]++;
+    }
+    uint32_t h[256];
+    for (int v=0;v<256;v++) h[v]=sub[0][v]+sub[1][v]+sub[2][v]+sub[3][v];
+    uint64_t n=(uint64_t)W*H, nl=(uint64_t)std::max(0,W-2)*std::max(0,H-2);
+
+    WellQC qc;
+    qc.saturation=(double)h[255]/n;
+    int bg=hist_percentile(h,n,0.5);
+    uint32_t dev[256]={};
+    for (int v=0;v<256;v++) dev[std::abs(v-bg)]+=h[v];
+    double sigma=std::max(1.0,1.4826*hist_percentile(dev,n,0.5));
+
+    // Laplacian of white noise has sigma*sqrt(20); its median magnitude is 0.6745 of that.
+    int lmed=0;
+    for (uint64_t acc=0;lmed<1023 && (acc+=lap[lmed])<=nl/2;lmed++) {}
+    const float fg=(float)(bg+QC_FOCUS_FG_SIGMA*std::max(0.5,lmed/0.6745/std::sqrt(20.0)));
+    if (W>2 && H>2) {
+        cv::Mat f, s;
+        frame.convertTo(f,CV_32F);
+        cv::GaussianBlur(f,s,cv::Size(0,0),1.0);
+        double grad=0, amp=0; int64_t cnt=0;
+        for (int y=1;y<H-1;y++) {
+            const float* r=s.ptr<float>(y);
+            const float* up=s.ptr<float>(y-1);
+            const float* dn=s.ptr<float>(y+1);
+            for (int x=1;x<W-1;x++) {
+                if (r[x]<=fg) continue;
+                float gx=r[x+1]-r[x-1], gy=dn[x]-up[x], a=r[x]-bg;
+                grad+=gx*gx+gy*gy; amp+=a*a; cnt++;
+            }
+        }
+        if (cnt>=QC_FOCUS_MIN_PIXELS) qc.focus=grad/(4*amp);
+    }
+    qc.background=bg;
+    qc.snr=(hist_percentile(h,n,0.99)-bg)/sigma;
+    if      (qc.focus<QC_MIN_FOCUS)           qc.reason="out_of_focus";
+    else if (qc.saturation>QC_MAX_SATURATION) qc.reason="saturated";
+    else if (qc.background>QC_MAX_BACKGROUND) qc.reason="overexposed";
+    else if (qc.snr<QC_MIN_SNR)               qc.reason="low_snr";
+    qc.pass=qc.reason.empty();
+    return qc;
+}
+
+static const int    CLUMP_FG_LEVEL = 25;       // same as the detector's lowest threshold
+static const double CLUMP_AREA_RATIO = 1.8;    // foreground area vs. area explained by its keypoints
+static const double CLUMP_PEAK_MIN = 4.0;      // px from the edge for a watershed seed
+static const int    CLUMP_SEED_SEP = 7;        // smallest cell radius: one seed per window
+
+// Optional declumping. One threshold + labelling pass finds foreground
+// components; only those the blob detector could not explain (no keypoint, or
+// much more area than their keypoints cover) are cut out and split with a
+// distance-transform seeded watershed, so the expensive part scales with the
+// number of clumps rather than the number of cells.
+std::vector<cv::KeyPoint> declump_cells(const cv::Mat& frame, const std::vector<cv::KeyPoint>& kps) {
+    cv::Mat fg, labels, stats, centroids;
+    cv::threshold(frame, fg, CLUMP_FG_LEVEL, 255, cv::THRESH_BINARY);
+    int n=cv::connectedComponentsWithStats(fg, labels, stats, centroids, 8);
+    std::vector<int> owner(kps.size());
+    std::vector<double> explained(n,0.0);
+    for (size_t k=0;k<kps.size();k++) {
+        int px=std::min(frame.cols-1,std::max(0,(int)kps[k].pt.x)), py=std::min(frame.rows-1,std::max(0,(int)kps[k].pt.y));
+        owner[k]=labels.at<int>(py,px);
+        explained[owner[k]]+=CV_PI*kps[k].size*kps[k].size/4;
+    }
+    std::vector<char> split(n,0);
+    for (int l=1;l<n;l++) {
+        int area=stats.at<int>(l,cv::CC_STAT_AREA);
+        split[l]=area>=60 && area>CLUMP_AREA_RATIO*explained[l];
+    }
+    std::vector<cv::KeyPoint> out;
+    for (size_t k=0;k<kps.size();k++) if (!split[owner[k]]) out.push_back(kps[k]);
+
+    cv::Mat kernel=cv::getStructuringElement(cv::MORPH_RECT, cv::Size(CLUMP_SEED_SEP,CLUMP_SEED_SEP));
+    cv::Mat mask, dist, peaks, markers, bgr;
+    for (int l=1;l<n;l++) {
+        if (!split[l]) continue;
+        const int* st=stats.ptr<int>(l);
+        cv::Rect roi=cv::Rect(st[cv::CC_STAT_LEFT]-2, st[cv::CC_STAT_TOP]-2, st[cv::CC_STAT_WIDTH]+4, st[cv::CC_STAT_HEIGHT]+4)
+                     & cv::Rect(0,0,frame.cols,frame.rows);
+        cv::compare(labels(roi), l, mask, cv::CMP_EQ);
+        cv::distanceTransform(mask, dist, cv::DIST_L2, 3);
+        cv::dilate(dist, peaks, kernel);
+        cv::compare(dist, peaks, peaks, cv::CMP_GE);
+        peaks.setTo(cv::Scalar(0), dist<CLUMP_PEAK_MIN);
+        int seeds=cv::connectedComponents(peaks, markers, 8, CV_32S)-1;
+        if (seeds<=1) {   // one cell the detector rejected on shape: keep it whole
+            const double* c=centroids.ptr<double>(l);
+            if (seeds==1) out.emplace_back((float)c[0], (float)c[1], (float)(2*std::sqrt(st[cv::CC_STAT_AREA]/CV_PI)));
+            continue;
+        }
+        markers.setTo(cv::Scalar(seeds+1), mask==0);   // everything outside the clump is one basin
+        cv::cvtColor(frame(roi), bgr, cv::COLOR_GRAY2BGR);
+        cv::watershed(bgr, markers);
+        std::vector<double> sx(seeds+1,0), sy(seeds+1,0), cnt(seeds+1,0);
+        for (int y=0;y<markers.rows;y++) {
+            const int* m=markers.ptr<int>(y);
+            for (int x=0;x<markers.cols;x++)
+                if (m[x]>0 && m[x]<=seeds) { sx[m[x]]+=x; sy[m[x]]+=y; cnt[m[x]]++; }
+        }
+        for (int m=1;m<=seeds;m++) if (cnt[m]>0)
+            out.emplace_back((float)(roi.x+sx[m]/cnt[m]), (float)(roi.y+sy[m]/cnt[m]), (float)(2*std::sqrt(cnt[m]/CV_PI)));
+    }
+    return out;
+}
+
+// COCO compressed RLE string (pycocotools rleToString): from the third count
+// on, each count is delta-coded against the one two before it, then written
+// as 5-bit groups with a continuation bit, offset into printable ASCII.
+std::string coco_rle_string(const std::vector<uint32_t>& counts) {
+    std::string s;
+    for (size_t i=0;i<counts.size();i++) {
+        int64_t x=counts[i];
+        if (i>2) x-=counts[i-2];
+        bool more=true;
+        while (more) {
+            int64_t c=x&0x1f;
+            x>>=5;
+            more=(c&0x10)?x!=-1:x!=0;
+            if (more) c|=0x20;
+            s+=(char)(c+48);
+        }
+    }
+    return s;
+}
+
+// Column-major (COCO) run-length masks for every keypoint, emitted while the
+// foreground label image is scanned once; pixels of a component shared by
+// several keypoints go to the nearest one. No per-cell image is ever built.
+std::vector<std::string> cell_masks_rle(const cv::Mat& frame, const std::vector<cv::KeyPoint>& kps) {
+    cv::Mat fg, labels, colmajor;
+    cv::threshold(frame, fg, CLUMP_FG_LEVEL, 255, cv::THRESH_BINARY);
+    int n=cv::connectedComponents(fg, labels, 8, CV_32S);
+    std::vector<std::vector<int>> owners(n);
+    for (size_t k=0;k<kps.size();k++) {
+        int px=std::min(frame.cols-1,std::max(0,(int)kps[k].pt.x)), py=std::min(frame.rows-1,std::max(0,(int)kps[k].pt.y));
+        int l=labels.at<int>(py,px);
+        if (l>0) owners[l].push_back((int)k);
+    }
+    cv::transpose(labels, colmajor);   // rows of colmajor are frame columns
+    const uint64_t total=(uint64_t)frame.rows*frame.cols;
+    std::vector<std::vector<uint32_t>> counts(kps.size());
+    std::vector<uint64_t> last(kps.size(),0);
+    int cur=-1; uint64_t start=0;
+    auto close=[&](uint64_t p) {
+        if (cur<0) return;
+        counts[cur].push_back((uint32_t)(start-last[cur]));
+        counts[cur].push_back((uint32_t)(p-start));
+        last[cur]=p;
+    };
+    for (int x=0;x<colmajor.rows;x++) {
+        const int* l=colmajor.ptr<int>(x);
+        for (int y=0;y<colmajor.cols;y++) {
+            const auto& o=owners[l[y]];
+            int owner=o.empty()?-1:o[0];
+            for (size_t i=1;i<o.size();i++) {
+                const auto& a=kps[o[i]].pt; const auto& b=kps[owner].pt;
+                if ((a.x-x)*(a.x-x)+(a.y-y)*(a.y-y)<(b.x-x)*(b.x-x)+(b.y-y)*(b.y-y)) owner=o[i];
+            }
+            if (owner==cur) continue;
+            uint64_t p=(uint64_t)x*frame.rows+y;
+            close(p);
+            cur=owner; start=p;
+        }
+    }
+    close(total);
+    std::vector<std::string> rle(kps.size());
+    for (size_t k=0;k<kps.size();k++) {
+        counts[k].push_back((uint32_t)(total-last[k]));   // trailing background (may be 0)
+        rle[k]=coco_rle_string(counts[k]);
+    }
+    return rle;
+}
+
+std::vector<cv::KeyPoint> detect_cells(const cv::Mat& frame, const AnalysisOptions& opt, const AnalyzerParams& prm) {
+    auto kps=opt.detector==DETECT_LOG?detect_log(frame):detect_blobs(frame,prm.blob);
+    if (opt.declump) kps=declump_cells(frame,kps);
+    return kps;
+}
+
+// Droplet interiors are the 4-connected regions enclosed by dark oil walls; one
+// labelling pass finds all of them, so cost is O(pixels) whatever the count.
+// Components clipped by the frame edge or not disc-shaped (interstices, the
+// continuous phase) are dropped.
+std::vector<Droplet> detect_droplets(const cv::Mat& frame) {
+    cv::Mat interior, labels, stats, centroids;
+    cv::threshold(frame, interior, DROPLET_WALL_LEVEL, 255, cv::THRESH_BINARY);
+    cv::erode(interior, interior, cv::Mat());   // seal 1 px gaps in the walls
+    int n=cv::connectedComponentsWithStats(interior, labels, stats, centroids, 4);
+    std::vector<Droplet> drops;
+    for (int l=1;l<n;l++) {
+        const int* st=stats.ptr<int>(l);
+        int x=st[cv::CC_STAT_LEFT], y=st[cv::CC_STAT_TOP], w=st[cv::CC_STAT_WIDTH], h=st[cv::CC_STAT_HEIGHT];
+        if (x==0||y==0||x+w>=frame.cols||y+h>=frame.rows) continue;
+        if (std::abs(w-h)>0.2*std::max(w,h)) continue;
+        double r=(w+h)/4.0;
+        if (r<DROPLET_MIN_R||r>DROPLET_MAX_R||st[cv::CC_STAT_AREA]<0.7*CV_PI*r*r) continue;
+        Droplet d; d.x=(float)(x+w/2.0); d.y=(float)(y+h/2.0); d.r=(float)r;
+        drops.push_back(d);
+    }
+    return drops;
+}
+
+// Uniform-grid spatial hash over droplet centres, stored CSR-style (bucket
+// offsets + droplet ids). Buckets are one droplet diameter wide, so a lookup
+// probes at most 3x3 buckets no matter how many droplets the frame holds.
+class DropletGrid {
+    const std::vector<Droplet>& drops;
+    float bucket; int gw, gh;
+    std::vector<int> start, ids;
+    int key(float x, float y) const {
+        int bx=std::min(gw-1,std::max(0,(int)(x/bucket))), by=std::min(gh-1,std::max(0,(int)(y/bucket)));
+        return by*gw+bx;
+    }
+public:
+    DropletGrid(const std::vector<Droplet>& d, int width, int height) : drops(d) {
+        float rmax=1;
+        for (auto& x:drops) rmax=std::max(rmax,x.r);
+        bucket=2*rmax+4; gw=(int)(width/bucket)+1; gh=(int)(height/bucket)+1;
+        start.assign(gw*gh+1,0);
+        for (auto& x:drops) start[key(x.x,x.y)+1]++;
+        for (int b=0;b<gw*gh;b++) start[b+1]+=start[b];
+        std::vector<int> fill(start.begin(),start.end()-1);
+        ids.resize(drops.size());
+        for (int i=0;i<(int)drops.size();i++) ids[fill[key(drops[i].x,drops[i].y)]++]=i;
+    }
+    // Droplet containing (x,y), or -1.
+    int find(float x, float y) const {
+        int bx=(int)(x/bucket), by=(int)(y/bucket), best=-1;
+        float bestd=1e30f;
+        for (int ny=std::max(0,by-1);ny<=std::min(gh-1,by+1);ny++)
+            for (int nx=std::max(0,bx-1);nx<=std::min(gw-1,bx+1);nx++)
+                for (int k=start[ny*gw+nx];k<start[ny*gw+nx+1];k++) {
+                    const auto& d=drops[ids[k]];
+                    float dx=x-d.x, dy=y-d.y, d2=dx*dx+dy*dy, lim=d.r+2;
+                    if (d2<=lim*lim && d2<bestd) { bestd=d2; best=ids[k]; }
+                }
+        return best;
+    }
+};
+
+// Assigns classified cells to droplets and summarises occupancy (0/1/2+) and viability.
+DropletStats droplet_occupancy(std::vector<Droplet>& drops, const std::vector<cv::KeyPoint>& kps,
+                               const std::vector<char>& alive, int width, int height) {
+    DropletStats s;
+    DropletGrid grid(drops, width, height);
+    for (size_t i=0;i<kps.size();i++) {
+        int d=grid.find(kps[i].pt.x, kps[i].pt.y);
+        if (d<0) { s.unassigned++; continue; }
+        alive[i]?drops[d].alive++:drops[d].dead++;
+    }
+    int singles_alive=0;
+    for (auto& d:drops) {
+        int n=d.alive+d.dead;
+        if (n==0) { s.empty++; continue; }
+        if (n==1) { s.single++; singles_alive+=d.alive; } else s.multi++;
+        s.mean_viability+=100.0*d.alive/n;
+    }
+    s.count=(int)drops.size();
+    int occupied=s.single+s.multi;
+    if (occupied) s.mean_viability/=occupied;
+    if (s.single) s.single_viability=100.0*singles_alive/s.single;
+    return s;
+}
+
+// Drug name (top-left) and efficacy (bottom-left) captions of a well frame.
+std::pair<std::string,std::string> well_labels(const std::string& drug, double efficacy) {
+    std::ostringstream eff;
+    eff<<std::fixed<<std::setprecision(0)<<efficacy<<"% eff.";
+    return {drug.size()>14?drug.substr(0,14):drug, eff.str()};
+}
+
+cv::Mat annotate_well(const cv::Mat& gray, const std::vector<cv::KeyPoint>& kps, const std::vector<char>& live,
                       const std::string& drug, double efficacy) {
     cv::Mat bgr;
     cv::cvtColor(gray,bgr,cv::COLOR_GRAY2BGR);
-    for (auto& kp:kps) {
-        bool a=classify_blob(gray,kp);
-        cv::Scalar col=a?cv::Scalar(60,200,60):cv::Scalar(60,60,220);
+    for (size_t k=0;k<kps.size();k++) {
+        const auto& kp=kps[k];
+        cv::Scalar col=live[k]?cv::Scalar(60,200,60):cv::Scalar(60,60,220);
         cv::circle(bgr,cv::Point((int)kp.pt.x,(int)kp.pt.y),(int)(kp.size/2)+2,col,2);
     }
-    std::string label=drug.size()>14?drug.substr(0,14):drug;
-    cv::putText(bgr,label,cv::Point(4,15),cv::FONT_HERSHEY_SIMPLEX,0.38,cv::Scalar(200,200,200),1);
-    std::ostringstream eff;
-    eff<<std::fixed<<std::setprecision(0)<<efficacy<<"% eff.";
-    cv::putText(bgr,eff.str(),cv::Point(4,bgr.rows-5),cv::FONT_HERSHEY_SIMPLEX,0.35,cv::Scalar(100,220,100),1);
+    auto labels=well_labels(drug,efficacy);
+    cv::putText(bgr,labels.first,cv::Point(4,15),cv::FONT_HERSHEY_SIMPLEX,0.38,cv::Scalar(200,200,200),1);
+    cv::putText(bgr,labels.second,cv::Point(4,bgr.rows-5),cv::FONT_HERSHEY_SIMPLEX,0.35,cv::Scalar(100,220,100),1);
     return bgr;
 }
 
+// Client-side alternative to annotate_well(): the same circles (centre,
+// radius, 1 = alive / 0 = dead) and captions as a compact JSON object.
+std::string overlay_json(const cv::Mat& gray, const std::vector<cv::KeyPoint>& kps, const std::vector<char>& live,
+                         const std::string& drug, double efficacy) {
+    auto labels=well_labels(drug,efficacy);
+    std::ostringstream j;
+    j<<std::fixed<<std::setprecision(1)<<"{\"width\":"<<gray.cols<<",\"height\":"<<gray.rows<<",\"cells\":[";
+    for (size_t k=0;k<kps.size();k++)
+        j<<(k?",":"")<<"["<<kps[k].pt.x<<","<<kps[k].pt.y<<","<<(int)(kps[k].size/2)+2<<","<<(live[k]?1:0)<<"]";
+    j<<"],\"labels\":[\""<<labels.first<<"\",\""<<labels.second<<"\"]}";
+    return j.str();
+}
+
 std::string b64(const std::vector<uchar>& data) {
     static const char* T="ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
     std::string out; out.reserve(((data.size()+2)/3)*4);
@@ -119,78 +1094,2297 @@ std::string b64(const std::vector<uchar>& data) {
     return out;
 }
 
-std::string run_full_analysis() {
-    std::vector<WellResult> wells;
-    for (int i=0;i<(int)DRUGS.size();i++) {
-        const auto& d=DRUGS[i];
-        cv::Mat frame=generate_well_frame(d.survival_rate);
-        auto kps=detect_blobs(frame);
-        int alive=0,dead=0;
-        for (auto& kp:kps) classify_blob(frame,kp)?alive++:dead++;
-        int total=alive+dead;
-        double viability=total>0?(100.0*alive/total):0.0;
-        double efficacy=100.0-viability;
-        cv::Mat ann=annotate_well(frame,kps,d.name,efficacy);
-        std::vector<uchar> buf;
-        cv::imencode(".png",ann,buf);
-        WellResult w;
-        w.well_index=i; w.drug_name=d.name; w.drug_category=d.category;
-        w.total_cells=total; w.alive_cells=alive; w.dead_cells=dead;
-        w.viability=viability; w.efficacy=efficacy; w.frame_b64=b64(buf);
-        wells.push_back(w);
-        std::cout<<"  Well "<<std::setw(2)<<i<<" ["<<d.name<<"] efficacy="
-                 <<std::fixed<<std::setprecision(1)<<efficacy<<"%"<<std::endl;
-    }
-    std::vector<WellResult*> ranked;
-    for (auto& w:wells) ranked.push_back(&w);
-    std::sort(ranked.begin(),ranked.end(),[](const WellResult* a,const WellResult* b){return a->efficacy>b->efficacy;});
+// Bounded in-memory registry of recent runs, newest last.
+class RunRegistry {
+    std::mutex mu;
+    std::deque<std::shared_ptr<const RunRecord>> runs;
+public:
+    void add(std::shared_ptr<const RunRecord> run) {
+        std::lock_guard<std::mutex> lock(mu);
+        runs.push_back(std::move(run));
+        if (runs.size()>RUN_CACHE_SIZE) runs.pop_front();
+    }
+    std::shared_ptr<const RunRecord> find(const std::string& id) {
+        std::lock_guard<std::mutex> lock(mu);
+        for (auto it=runs.rbegin();it!=runs.rend();++it) if ((*it)->id==id) return *it;
+        return nullptr;
+    }
+};
+
+RunRegistry RUNS;
+
+// Append-only log of finished runs, $RUN_STORE_DIR/runs.log (default ./runs).
+// Records are little-endian:
+//   char magic[4] = "LOCR"; uint32 header bytes; uint64 body bytes;
+//   header: int64 timestamp; str16 run id; str16 patient id; str16 cohort
+//   body:   str32 summary JSON; uint32 wells;
+//           per well: int32 index; float64 efficacy, viability; uint8 qc pass; str16 drug, category
+//           per well: FRAME_LEVELS x str32 PNG; uint16 thumb width, height; raw thumb pixels
+//           uint32 cells; columns in CellTable order, each cells x
+//           (int32 well; float32 x, y, area, mean, max, circularity, ring, texture; uint8 alive)
+// (records written before cell rows were stored end after the thumbnails)
+// (strN: uintN length, then the bytes). The indexes by run id and by
+// (patient, timestamp) are in-memory maps rebuilt at startup from the record
+// headers alone; a torn record at the tail (crash mid-append) is cut off.
+class RunStore {
+    struct Bytes {
+        std::string b;
+        template<class T> void put(T v) { b.append((const char*)&v,sizeof v); }
+        template<class L> void str(const void* p, size_t n) { put((L)n); b.append((const char*)p,n); }
+        template<class L> void str(const std::string& s) { str<L>(s.data(),s.size()); }
+    };
+    struct Reader {
+        const char *p, *end;
+        bool ok=true;
+        template<class T> T get() {
+            T v{};
+            if (!ok || end-p<(long)sizeof v) { ok=false; return v; }
+            std::memcpy(&v,p,sizeof v); p+=sizeof v;
+            return v;
+        }
+        std::string raw(size_t n) {
+            if (!ok || end-p<(long)n) { ok=false; return std::string(); }
+            p+=n;
+            return std::string(p-n,n);
+        }
+        template<class L> std::string str() { size_t n=get<L>(); return raw(n); }
+    };
+    static const size_t PREFIX=16;   // magic, header bytes, body bytes
+    std::mutex mu;
+    std::string path;
+    std::ofstream log;
+    uint64_t end=0;
+    std::map<std::string,uint64_t> by_id;                                   // -> record offset
+    std::map<std::tuple<std::string,int64_t,std::string>,uint64_t> by_patient; // (patient, time, id)
+
+    // Header fields of the record at off; false past the end or on a torn record.
+    bool read_prefix(std::ifstream& in, uint64_t off, uint64_t size, uint32_t& hlen, uint64_t& blen) {
+        char pre[PREFIX];
+        in.seekg(off);
+        if (!in.read(pre,PREFIX) || std::memcmp(pre,"LOCR",4)) return false;
+        std::memcpy(&hlen,pre+4,4); std::memcpy(&blen,pre+8,8);
+        return off+PREFIX+hlen+blen<=size;
+    }
+    // Body of the run at off, or just its first `limit` bytes; the header
+    // is returned through `header` when asked for.
+    std::string read_body(std::ifstream& in, uint64_t off, uint64_t limit=UINT64_MAX, std::string* header=nullptr) {
+        uint32_t hlen; uint64_t blen;
+        in.clear();
+        if (!in.is_open() || !read_prefix(in,off,UINT64_MAX,hlen,blen)) return std::string();
+        if (header) { header->resize(hlen); in.read(&(*header)[0],hlen); }
+        std::string body(std::min(blen,limit),'\0');
+        in.seekg(off+PREFIX+hlen);
+        in.read(&body[0],body.size());
+        body.resize(in.gcount());
+        return body;
+    }
+    std::string read_body(uint64_t off, uint64_t limit=UINT64_MAX) {
+        std::ifstream in(path,std::ios::binary);
+        return read_body(in,off,limit);
+    }
+    static void read_header(Reader& r, RunRecord& run) {
+        run.timestamp=r.get<int64_t>();
+        run.id=r.str<uint16_t>(); run.patient=r.str<uint16_t>();
+        if (r.ok && r.p<r.end) run.cohort=r.str<uint16_t>();
+    }
+    static void read_wells(Reader& r, RunRecord& run) {
+        uint32_t n=r.get<uint32_t>();
+        for (uint32_t i=0;i<n && r.ok;i++) {
+            WellSummary w;
+            w.well_index=r.get<int32_t>(); w.efficacy=r.get<double>(); w.viability=r.get<double>();
+            w.qc_pass=r.get<uint8_t>(); w.drug=r.str<uint16_t>(); w.category=r.str<uint16_t>();
+            run.wells.push_back(w);
+        }
+    }
+    uint64_t lookup(const std::string& id) {
+        std::lock_guard<std::mutex> lock(mu);
+        auto it=by_id.find(id);
+        return it==by_id.end()?UINT64_MAX:it->second;
+    }
+public:
+    bool open(const std::string& dir) {
+        std::error_code ec;
+        std::filesystem::create_directories(dir,ec);
+        path=dir+"/runs.log";
+        uint64_t size=std::filesystem::exists(path,ec)?std::filesystem::file_size(path,ec):0;
+        std::ifstream in(path,std::ios::binary);
+        uint32_t hlen; uint64_t blen;
+        while (in && read_prefix(in,end,size,hlen,blen)) {
+            std::string h(hlen,'\0');
+            in.read(&h[0],hlen);
+            Reader r{h.data(),h.data()+h.size()};
+            RunRecord run;
+            read_header(r,run);
+            if (!r.ok) break;
+            by_id[run.id]=end;
+            by_patient[std::make_tuple(run.patient,run.timestamp,run.id)]=end;
+            end+=PREFIX+hlen+blen;
+        }
+        in.close();
+        if (end<size) {
+            std::cerr<<"run store: dropping "<<size-end<<" bytes of torn record at the end of "<<path<<std::endl;
+            std::filesystem::resize_file(path,end,ec);
+        }
+        log.open(path,std::ios::binary|std::ios::app);
+        if (log) std::cout<<"Run store "<<path<<": "<<by_id.size()<<" runs"<<std::endl;
+        return (bool)log;
+    }
+
+    void add(const RunRecord& run) {
+        if (!log.is_open()) return;
+        Bytes h, b;
+        h.put((int64_t)run.timestamp); h.str<uint16_t>(run.id); h.str<uint16_t>(run.patient);
+        h.str<uint16_t>(run.cohort);
+        b.str<uint32_t>(run.summary);
+        b.put((uint32_t)run.wells.size());
+        for (const auto& w:run.wells) {
+            b.put((int32_t)w.well_index); b.put(w.efficacy); b.put(w.viability); b.put((uint8_t)w.qc_pass);
+            b.str<uint16_t>(w.drug); b.str<uint16_t>(w.category);
+        }
+        for (size_t i=0;i<run.wells.size();i++) {
+            for (int l=0;l<FRAME_LEVELS;l++) b.str<uint32_t>(run.frames[i][l].data(),run.frames[i][l].size());
+            const Thumb& t=run.thumbs[i];
+            b.put((uint16_t)t.width); b.put((uint16_t)t.height);
+            b.b.append((const char*)t.px.data(),t.px.size());
+        }
+        const CellTable& c=run.cells;
+        b.put((uint32_t)c.size());
+        auto column=[&](const auto& v){ b.b.append((const char*)v.data(),v.size()*sizeof(v[0])); };
+        column(c.well); column(c.x); column(c.y); column(c.area); column(c.mean); column(c.max);
+        column(c.circularity); column(c.ring); column(c.texture); column(c.alive);
+        Bytes pre;
+        pre.b.append("LOCR",4); pre.put((uint32_t)h.b.size()); pre.put((uint64_t)b.b.size());
+        std::lock_guard<std::mutex> lock(mu);
+        log<<pre.b<<h.b<<b.b;
+        log.flush();
+        if (!log) { std::cerr<<"run store: write failed, "<<run.id<<" not persisted"<<std::endl; log.clear(); return; }
+        by_id[run.id]=end;
+        by_patient[std::make_tuple(run.patient,run.timestamp,run.id)]=end;
+        end+=pre.b.size()+h.b.size()+b.b.size();
+    }
+
+    // Summary JSON of a stored run, reading only the front of its body.
+    std::string summary(const std::string& id) {
+        uint64_t off=lookup(id);
+        if (off==UINT64_MAX) return std::string();
+        std::string head=read_body(off,4);
+        if (head.size()<4) return std::string();
+        uint32_t n; std::memcpy(&n,head.data(),4);
+        return read_body(off,4+(uint64_t)n).substr(4);
+    }
+
+    // Wells, frames, thumbnails and cell rows of a stored run (masks are not persisted).
+    std::shared_ptr<RunRecord> load(const std::string& id) {
+        uint64_t off=lookup(id);
+        if (off==UINT64_MAX) return nullptr;
+        std::string body=read_body(off);
+        Reader r{body.data(),body.data()+body.size()};
+        auto run=std::make_shared<RunRecord>();
+        run->id=id;
+        run->summary=r.str<uint32_t>();
+        read_wells(r,*run);
+        for (size_t i=0;i<run->wells.size() && r.ok;i++) {
+            FramePyramid png;
+            for (int l=0;l<FRAME_LEVELS;l++) { std::string s=r.str<uint32_t>(); png[l].assign(s.begin(),s.end()); }
+            Thumb t;
+            t.width=r.get<uint16_t>(); t.height=r.get<uint16_t>();
+            std::string px=r.raw((size_t)t.width*t.height);
+            t.px.assign(px.begin(),px.end());
+            run->frames.push_back(std::move(png));
+            run->thumbs.push_back(std::move(t));
+        }
+        run->cells_kept=r.ok && r.p<r.end;
+        if (run->cells_kept) {
+            size_t n=r.get<uint32_t>();
+            CellTable& c=run->cells;
+            auto column=[&](auto& v){
+                std::string raw=r.raw(n*sizeof(v[0]));
+                v.resize(r.ok?n:0);
+                if (r.ok) std::memcpy(v.data(),raw.data(),raw.size());
+            };
+            column(c.well); column(c.x); column(c.y); column(c.area); column(c.mean); column(c.max);
+            column(c.circularity); column(c.ring); column(c.texture); column(c.alive);
+        }
+        return r.ok?run:nullptr;
+    }
+
+    // Header and per-well metrics of every stored run, in file order, through
+    // one stream; frames are never read. Used to rebuild derived indexes.
+    void scan(const std::function<void(const RunRecord&)>& fn) {
+        std::vector<uint64_t> offsets;
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            for (const auto& e:by_id) offsets.push_back(e.second);
+        }
+        std::sort(offsets.begin(),offsets.end());
+        std::ifstream in(path,std::ios::binary);
+        for (uint64_t off:offsets) {
+            std::string header, body=read_body(in,off,64*1024,&header);
+            Reader h{header.data(),header.data()+header.size()};
+            RunRecord run;
+            read_header(h,run);
+            Reader r{body.data(),body.data()+body.size()};
+            r.str<uint32_t>();   // summary
+            read_wells(r,run);
+            if (!r.ok) {         // metrics run past the first 64 KiB
+                body=read_body(in,off);
+                r=Reader{body.data(),body.data()+body.size()};
+                r.str<uint32_t>();
+                run.wells.clear();
+                read_wells(r,run);
+            }
+            if (h.ok && r.ok) fn(run);
+        }
+    }
+
+    // Runs of one patient with since <= timestamp <= until, oldest first.
+    std::vector<std::pair<std::string,int64_t>> list(const std::string& patient, int64_t since, int64_t until, size_t limit) {
+        std::lock_guard<std::mutex> lock(mu);
+        std::vector<std::pair<std::string,int64_t>> out;
+        for (auto it=by_patient.lower_bound(std::make_tuple(patient,since,std::string()));
+             it!=by_patient.end() && out.size()<limit; ++it) {
+            if (std::get<0>(it->first)!=patient || std::get<1>(it->first)>until) break;
+            out.push_back({std::get<2>(it->first),std::get<1>(it->first)});
+        }
+        return out;
+    }
+};
+
+RunStore STORE;
+
+static const int EFFICACY_SHARDS = 16;
+
+struct DrugStats {
+    std::string drug;
+    size_t n=0;
+    double mean=0, median=0;
+    double percentile=-1;   // rank of the queried value, -1 when none was given
+};
+
+// Efficacy of every QC-passing well of every run, by drug and cohort, for
+// cross-run questions ("how does Paclitaxel rank across breast-cancer
+// patients"). Runs are spread over shards by run id; each shard keeps its
+// values sorted and has its own lock, so completed runs are added while
+// queries read the other shards. A query fans out one task per shard, which
+// sums its values and copies the sorted lists out; the median is then the
+// k-th value across all sorted lists, found by bisection, and a percentile
+// rank is a count below the value.
+class EfficacyIndex {
+    struct Shard {
+        std::mutex mu;
+        std::map<std::string,std::map<std::string,std::vector<float>>> values;   // drug -> cohort -> sorted
+    };
+    std::array<Shard,EFFICACY_SHARDS> shards;
+
+    typedef std::vector<const std::vector<float>*> Lists;
+    static size_t count_le(const Lists& lists, float v) {
+        size_t n=0;
+        for (auto* l:lists) n+=std::upper_bound(l->begin(),l->end(),v)-l->begin();
+        return n;
+    }
+    // Order-preserving float <-> uint32 mapping, so bisection over the
+    // integers visits every float between two finite bounds exactly.
+    static uint32_t key(float f) { uint32_t u; std::memcpy(&u,&f,4); return u&0x80000000u?~u:u|0x80000000u; }
+    static float unkey(uint32_t u) { u=u&0x80000000u?u&0x7fffffffu:~u; float f; std::memcpy(&f,&u,4); return f; }
+    // k-th smallest (0-based) value across sorted lists.
+    static float kth(const Lists& lists, size_t k) {
+        float lo=INFINITY, hi=-INFINITY;
+        for (auto* l:lists) if (!l->empty()) { lo=std::min(lo,l->front()); hi=std::max(hi,l->back()); }
+        uint32_t a=key(lo), b=key(hi);
+        while (a<b) {
+            uint32_t mid=a+(b-a)/2;
+            if (count_le(lists,unkey(mid))>k) b=mid; else a=mid+1;
+        }
+        return unkey(a);
+    }
+public:
+    void add(const RunRecord& run) {
+        Shard& s=shards[std::hash<std::string>()(run.id)%EFFICACY_SHARDS];
+        std::lock_guard<std::mutex> lock(s.mu);
+        for (const auto& w:run.wells) {
+            if (!w.qc_pass) continue;
+            auto& v=s.values[w.drug][run.cohort];
+            float e=(float)w.efficacy;
+            v.insert(std::upper_bound(v.begin(),v.end(),e),e);
+        }
+    }
+
+    // Per-drug stats over one cohort (every cohort when empty). values[d],
+    // when present and >= 0, is ranked against drug d's distribution.
+    std::vector<DrugStats> query(const std::vector<std::string>& drugs, const std::string& cohort,
+                                 const std::vector<double>& values={}) {
+        struct Part {
+            std::vector<double> sum;
+            std::vector<std::vector<std::vector<float>>> lists;   // per drug, per matching cohort
+        };
+        std::vector<std::future<Part>> parts;
+        for (auto& shard:shards)
+            parts.push_back(std::async(std::launch::async,[&drugs,&cohort,&shard]{
+                Part p;
+                p.sum.assign(drugs.size(),0.0); p.lists.resize(drugs.size());
+                std::lock_guard<std::mutex> lock(shard.mu);
+                for (size_t d=0;d<drugs.size();d++) {
+                    auto it=shard.values.find(drugs[d]);
+                    if (it==shard.values.end()) continue;
+                    for (const auto& c:it->second) {
+                        if (!cohort.empty() && c.first!=cohort) continue;
+                        for (float v:c.second) p.sum[d]+=v;
+                        p.lists[d].push_back(c.second);
+                    }
+                }
+                return p;
+            }));
+        std::vector<Part> got;
+        for (auto& f:parts) got.push_back(f.get());
+        std::vector<DrugStats> out(drugs.size());
+        for (size_t d=0;d<drugs.size();d++) {
+            DrugStats& st=out[d];
+            st.drug=drugs[d];
+            Lists lists;
+            double sum=0;
+            for (const auto& p:got) {
+                sum+=p.sum[d];
+                for (const auto& l:p.lists[d]) { lists.push_back(&l); st.n+=l.size(); }
+            }
+            if (!st.n) continue;
+            st.mean=sum/st.n;
+            st.median=st.n%2?kth(lists,st.n/2):0.5*(kth(lists,st.n/2-1)+kth(lists,st.n/2));
+            if (d<values.size() && values[d]>=0) {
+                float v=(float)values[d];
+                size_t below=0, le=count_le(lists,v);
+                for (auto* l:lists) below+=std::lower_bound(l->begin(),l->end(),v)-l->begin();
+                st.percentile=100.0*(below+0.5*(le-below))/st.n;
+            }
+        }
+        return out;
+    }
+};
+
+EfficacyIndex EFFICACY;
+
+// A run from the in-memory cache, else from the store. Store records lack
+// masks (and cells, if written before those were stored), so they are not
+// cached where they could evict a complete run.
+std::shared_ptr<const RunRecord> find_run(const std::string& id) {
+    if (auto run=RUNS.find(id)) return run;
+    return STORE.load(id);
+}
+
+// Local time, a per-process random tag and a sequence number: a restart
+// within the same second draws a new tag, so its ids cannot shadow runs
+// already in the store.
+std::string new_run_id() {
+    static const unsigned tag=std::random_device()()&0xffffff;
+    static std::atomic<int> seq(0);
+    std::time_t t=std::time(nullptr);
+    std::tm tm{};
+    localtime_r(&t,&tm);
+    char buf[32];
+    std::strftime(buf,sizeof(buf),"%Y%m%d-%H%M%S",&tm);
+    std::ostringstream id;
+    id<<buf<<"-"<<std::hex<<std::setfill('0')<<std::setw(6)<<tag<<std::dec<<"-"<<std::setw(4)<<(seq++%10000);
+    return id.str();
+}
+
+static const int PLATE_MAX_WIDTH = 1280;
+
+// Smallest standard plate (rows x cols) holding n wells.
+std::pair<int,int> plate_layout(int n) {
+    static const int fmt[][2]={{2,3},{3,4},{4,6},{6,8},{8,12},{16,24},{32,48}};
+    for (const auto& f:fmt) if (f[0]*f[1]>=n) return {f[0],f[1]};
+    int cols=(int)std::ceil(std::sqrt(n*1.5));
+    return {(n+cols-1)/cols,cols};
+}
+
+// 0-100 % -> BGR along viridis, interpolated once from five control points.
+const uchar* heat_colour(double pct) {
+    static uchar lut[256][3];
+    static bool built=[]{
+        static const double cp[5][3]={{84,1,68},{139,82,59},{140,145,33},{98,201,94},{37,231,253}};
+        for (int i=0;i<256;i++) {
+            double t=i/255.0*4; int k=std::min(3,(int)t); double f=t-k;
+            for (int c=0;c<3;c++) lut[i][c]=(uchar)(cp[k][c]+(cp[k+1][c]-cp[k][c])*f+0.5);
+        }
+        return true;
+    }();
+    (void)built;
+    return lut[std::min(255,std::max(0,(int)(pct*2.55+0.5)))];
+}
+
+// Whole-plate overview: one tile per well coloured by efficacy or viability
+// (QC failures grey), optionally framing a nearest-sampled thumbnail. Tiles
+// are written straight into one preallocated BGR image, which is encoded
+// once; tile size shrinks with the plate so 1536-well layouts stay bounded.
+std::vector<uchar> render_plate(const RunRecord& run, bool viability, bool thumbs) {
+    int n=(int)run.wells.size();
+    auto layout=plate_layout(std::max(1,n));
+    int rows=layout.first, cols=layout.second;
+    int tile=std::max(12,std::min(96,PLATE_MAX_WIDTH/cols)), gap=std::max(1,tile/16), sz=tile-gap;
+    cv::Mat img(rows*tile+gap, cols*tile+gap, CV_8UC3, cv::Scalar(24,24,24));
+    static const uchar grey[3]={110,110,110};
+    for (int i=0;i<n;i++) {
+        const auto& w=run.wells[i];
+        const uchar* col=w.qc_pass?heat_colour(viability?w.viability:w.efficacy):grey;
+        const Thumb* th=thumbs && i<(int)run.thumbs.size() && !run.thumbs[i].px.empty()?&run.thumbs[i]:nullptr;
+        int border=th?std::max(2,sz/8):sz, inner=std::max(1,sz-2*border);
+        int x0=(i%cols)*tile+gap, y0=(i/cols)*tile+gap;
+        for (int y=0;y<sz;y++) {
+            uchar* p=img.ptr<uchar>(y0+y)+3*x0;
+            bool edge_row=y<border||y>=sz-border;
+            const uchar* trow=th&&!edge_row?&th->px[std::min(th->height-1,(y-border)*th->height/inner)*th->width]:nullptr;
+            for (int x=0;x<sz;x++,p+=3) {
+                if (edge_row||x<border||x>=sz-border) { p[0]=col[0]; p[1]=col[1]; p[2]=col[2]; continue; }
+                uchar g=trow[std::min(th->width-1,(x-border)*th->width/inner)];
+                p[0]=p[1]=p[2]=g;
+            }
+        }
+    }
+    std::vector<uchar> png;
+    cv::imencode(".png",img,png);
+    return png;
+}
+
+// Columnar binary cell export, little-endian:
+//   char magic[8] = "LOCCELL1"; uint32 columns; uint32 reserved; uint64 rows;
+//   per column: uint8 type (1 = int32, 2 = float32, 3 = uint8), uint8 name length, name;
+//   zero padding to a multiple of 8, then each column's values back to back,
+//   each column padded to a multiple of 8 so readers can map them in place.
+std::string cells_columnar(const CellTable& t) {
+    struct Col { const char* name; uint8_t type; const void* data; size_t width; };
+    const Col cols[]={
+        {"well",1,t.well.data(),4}, {"x",2,t.x.data(),4}, {"y",2,t.y.data(),4},
+        {"area",2,t.area.data(),4}, {"mean",2,t.mean.data(),4}, {"max",2,t.max.data(),4},
+        {"circularity",2,t.circularity.data(),4}, {"ring",2,t.ring.data(),4},
+        {"texture",2,t.texture.data(),4}, {"alive",3,t.alive.data(),1},
+    };
+    std::string out("LOCCELL1",8);
+    auto put=[&](const void* p, size_t n){ out.append((const char*)p,n); };
+    auto pad=[&]{ out.append((8-out.size()%8)%8,'\0'); };
+    uint32_t ncols=sizeof(cols)/sizeof(cols[0]), reserved=0;
+    uint64_t rows=t.size();
+    put(&ncols,4); put(&reserved,4); put(&rows,8);
+    for (const auto& c:cols) {
+        uint8_t len=(uint8_t)std::strlen(c.name);
+        put(&c.type,1); put(&len,1); put(c.name,len);
+    }
+    pad();
+    for (const auto& c:cols) { put(c.data,c.width*rows); pad(); }
+    return out;
+}
+
+std::string cells_csv(const CellTable& t) {
+    std::ostringstream o;
+    o<<"well,x,y,area,mean,max,circularity,ring,texture,alive\n"<<std::fixed<<std::setprecision(2);
+    for (size_t i=0;i<t.size();i++)
+        o<<t.well[i]<<","<<t.x[i]<<","<<t.y[i]<<","<<t.area[i]<<","<<t.mean[i]<<","
+         <<t.max[i]<<","<<t.circularity[i]<<","<<t.ring[i]<<","<<t.texture[i]<<","
+         <<(int)t.alive[i]<<"\n";
+    return o.str();
+}
+
+double elapsed_ms(std::chrono::steady_clock::time_point t0) {
+    return std::chrono::duration<double,std::milli>(std::chrono::steady_clock::now()-t0).count();
+}
+
+// Latency histogram with fixed Prometheus buckets, updated with relaxed
+// atomics only so timing a stage never takes a lock. Buckets hold plain
+// counts; they are made cumulative when written out.
+class LatencyHistogram {
+    static constexpr int BUCKETS=14;
+    static constexpr double BOUNDS[BUCKETS]={0.0005,0.001,0.0025,0.005,0.01,0.025,0.05,0.1,0.25,0.5,1,2.5,5,10};
+    std::array<std::atomic<uint64_t>,BUCKETS+1> counts{};   // last: above every bound
+    std::atomic<uint64_t> sum_ns{0};
+public:
+    void observe(double ms) {
+        double sec=ms/1000;
+        int b=0;
+        while (b<BUCKETS && sec>BOUNDS[b]) b++;
+        counts[b].fetch_add(1,std::memory_order_relaxed);
+        sum_ns.fetch_add((uint64_t)(ms*1e6),std::memory_order_relaxed);
+    }
+    void write(std::ostream& out, const std::string& name, const std::string& labels) const {
+        std::string sep=labels.empty()?"":",";
+        uint64_t acc=0;
+        for (int b=0;b<=BUCKETS;b++) {
+            acc+=counts[b].load(std::memory_order_relaxed);
+            out<<name<<"_bucket{"<<labels<<sep<<"le=\"";
+            if (b<BUCKETS) out<<BOUNDS[b]; else out<<"+Inf";
+            out<<"\"} "<<acc<<"\n";
+        }
+        std::string braces=labels.empty()?"":"{"+labels+"}";
+        out<<name<<"_sum"<<braces<<" "<<sum_ns.load(std::memory_order_relaxed)/1e9<<"\n";
+        out<<name<<"_count"<<braces<<" "<<acc<<"\n";
+    }
+};
+
+enum Stage { STAGE_GENERATE, STAGE_DETECT, STAGE_CLASSIFY, STAGE_ANNOTATE, STAGE_ENCODE, STAGE_SERIALIZE, STAGE_COUNT };
+static const char* const STAGE_NAMES[STAGE_COUNT]={"generate","detect","classify","annotate","encode","serialize"};
+
+LatencyHistogram STAGE_TIMES[STAGE_COUNT];   // per well, serialize per run
+LatencyHistogram RUN_TIMES;
+std::atomic<int> RUNS_IN_FLIGHT(0), HTTP_QUEUE_DEPTH(0);
+std::atomic<uint64_t> RUNS_TOTAL(0);
+
+thread_local bool STAGES_UNTIMED=false;   // set while warming up, which stays out of /metrics
+
+// Adds the time until it leaves scope to one stage's histogram.
+struct StageTimer {
+    Stage stage;
+    std::chrono::steady_clock::time_point t0=std::chrono::steady_clock::now();
+    explicit StageTimer(Stage s) : stage(s) {}
+    ~StageTimer() { if (!STAGES_UNTIMED) STAGE_TIMES[stage].observe(elapsed_ms(t0)); }
+};
+
+// CPUs analysis may run on (ANALYZER_CPUS, e.g. "1-3"), so the core used for
+// acquisition can be kept free. The set is applied to the main thread at
+// startup and inherited by every thread created after it: HTTP workers,
+// OpenCV's pool, worker pools. With ANALYZER_PIN=1 each worker is further
+// bound to a single CPU of the set.
+std::vector<int> ANALYSIS_CPUS;   // empty: whatever the process was given
+bool PIN_WORKERS=false;
+
+// "0,2-3" -> {0,2,3}; malformed parts are skipped.
+std::vector<int> parse_cpu_list(const std::string& text) {
+    std::vector<int> cpus;
+    std::stringstream ss(text);
+    std::string part;
+    while (std::getline(ss,part,',')) {
+        int lo=-1, hi=-1, n=std::sscanf(part.c_str(),"%d-%d",&lo,&hi);
+        if (n<1 || lo<0) continue;
+        if (n==1) hi=lo;
+        for (int c=lo;c<=hi && c<CPU_SETSIZE;c++) cpus.push_back(c);
+    }
+    std::sort(cpus.begin(),cpus.end());
+    cpus.erase(std::unique(cpus.begin(),cpus.end()),cpus.end());
+    return cpus;
+}
+
+bool set_thread_cpus(const std::vector<int>& cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int c:cpus) CPU_SET(c,&set);
+    return pthread_setaffinity_np(pthread_self(),sizeof(set),&set)==0;
+}
+
+// Cores analysis work may use: the calling thread's affinity mask, which
+// also honours a container's --cpuset-cpus (hardware_concurrency does not).
+unsigned analysis_cores() {
+    cpu_set_t set;
+    if (sched_getaffinity(0,sizeof(set),&set)==0 && CPU_COUNT(&set)>0) return (unsigned)CPU_COUNT(&set);
+    return std::max(1u,std::thread::hardware_concurrency());
+}
+
+// Reads ANALYZER_CPUS / ANALYZER_PIN; call before any thread is started.
+void configure_cpus() {
+    const char* list=std::getenv("ANALYZER_CPUS");
+    const char* pin=std::getenv("ANALYZER_PIN");
+    PIN_WORKERS=pin && std::atoi(pin)!=0;
+    if (!list || !*list) return;
+    ANALYSIS_CPUS=parse_cpu_list(list);
+    if (ANALYSIS_CPUS.empty() || !set_thread_cpus(ANALYSIS_CPUS)) {
+        std::cerr<<"ANALYZER_CPUS="<<list<<" not usable here, running on all CPUs"<<std::endl;
+        ANALYSIS_CPUS.clear();
+        return;
+    }
+    std::cout<<"Analysis CPUs: "<<list<<(PIN_WORKERS?" (workers pinned)":"")<<std::endl;
+}
+
+// Binds the calling thread to the CPU of worker `index` when pinning is on.
+void pin_worker(unsigned index) {
+    if (PIN_WORKERS && !ANALYSIS_CPUS.empty()) set_thread_cpus({ANALYSIS_CPUS[index%ANALYSIS_CPUS.size()]});
+}
+
+// Busy time of one worker thread. `cpu` is where its last job ended, which
+// with a CPU set shows whether the partitioning holds.
+struct WorkerStats {
+    std::string pool;
+    unsigned index=0;
+    std::chrono::steady_clock::time_point since=std::chrono::steady_clock::now();
+    std::atomic<uint64_t> busy_ns{0}, jobs{0};
+    std::atomic<int> cpu{-1};
+    void record(std::chrono::steady_clock::time_point t0) {
+        busy_ns.fetch_add((uint64_t)(elapsed_ms(t0)*1e6),std::memory_order_relaxed);
+        jobs.fetch_add(1,std::memory_order_relaxed);
+        cpu.store(sched_getcpu(),std::memory_order_relaxed);
+    }
+    double utilization() const {
+        double up=elapsed_ms(since)*1e6;
+        return up>0?std::min(1.0,busy_ns.load(std::memory_order_relaxed)/up):0;
+    }
+};
+
+// Live workers of every pool. A new worker takes the lowest index free in
+// its pool, so labels stay stable while httplib grows and shrinks its pool.
+class WorkerRegistry {
+    mutable std::mutex mu;
+    std::vector<std::shared_ptr<WorkerStats>> all;
+public:
+    std::shared_ptr<WorkerStats> add(const std::string& pool) {
+        std::lock_guard<std::mutex> lock(mu);
+        auto w=std::make_shared<WorkerStats>();
+        w->pool=pool;
+        while (std::any_of(all.begin(),all.end(),[&](const std::shared_ptr<WorkerStats>& o){ return o->pool==pool && o->index==w->index; }))
+            w->index++;
+        all.push_back(w);
+        return w;
+    }
+    void remove(const WorkerStats* w) {
+        std::lock_guard<std::mutex> lock(mu);
+        all.erase(std::remove_if(all.begin(),all.end(),[&](const std::shared_ptr<WorkerStats>& o){ return o.get()==w; }),all.end());
+    }
+    std::vector<std::shared_ptr<WorkerStats>> snapshot() const {
+        std::lock_guard<std::mutex> lock(mu);
+        return all;
+    }
+};
+WorkerRegistry WORKERS;
+
+// Registers (and pins) the calling thread as a worker of `pool` for as long
+// as the thread lives.
+struct WorkerSlot {
+    std::shared_ptr<WorkerStats> stats;
+    explicit WorkerSlot(const std::string& pool) : stats(WORKERS.add(pool)) { pin_worker(stats->index); }
+    ~WorkerSlot() { WORKERS.remove(stats.get()); }
+};
+
+// httplib's thread pool, counting accepted connections still waiting for a worker.
+class MeteredTaskQueue : public httplib::TaskQueue {
+    httplib::ThreadPool pool;
+public:
+    MeteredTaskQueue() : pool(CPPHTTPLIB_THREAD_POOL_COUNT,CPPHTTPLIB_THREAD_POOL_MAX_COUNT) {}
+    bool enqueue(std::function<void()> fn) override {
+        HTTP_QUEUE_DEPTH++;
+        bool ok=pool.enqueue([fn=std::move(fn)]{
+            HTTP_QUEUE_DEPTH--;
+            thread_local WorkerSlot slot("http");
+            auto t0=std::chrono::steady_clock::now();
+            fn();
+            slot.stats->record(t0);
+        });
+        if (!ok) HTTP_QUEUE_DEPTH--;
+        return ok;
+    }
+    void shutdown() override { pool.shutdown(); }
+};
+
+// Rough peak memory of one plate analysis with `in_flight` wells analysed at
+// once: per-well scratch (float intermediates of correction/LoG/EDF,
+// annotated BGR copy) plus the PNG pyramid, inlined base64 and thumbnail held
+// per well, for every well unless the run streams.
+size_t estimate_run_bytes(const AnalysisOptions& opt, size_t in_flight) {
+    size_t px=(size_t)opt.frame_size*opt.frame_size;
+    size_t held=opt.stream?in_flight:DRUGS.size();
+    return in_flight*px*(16+4*(size_t)std::max(1,opt.z_planes)) + held*px*3;
+}
+
+// Bounded admission for /api/analyze. At most `concurrency` analyses run at
+// once and their estimated working sets stay within the memory budget; up to
+// `queue_limit` more wait in FIFO order for `timeout_ms`, and anything beyond
+// that is turned away at once, so a burst of clients cannot push the device
+// into OOM or tie up every HTTP worker.
+class AdmissionControl {
+    std::mutex mu;
+    std::condition_variable turn;
+    std::deque<uint64_t> waiting;   // tickets, oldest first
+    uint64_t next_ticket=0;
+    int running=0;
+    size_t mem_used=0;
+    double avg_run_ms=2000;         // moving average, for Retry-After
+public:
+    int concurrency=1, queue_limit=8, timeout_ms=30000;
+    size_t budget=1024ull<<20;
+    std::atomic<uint64_t> rejected{0};
+    enum Verdict { ADMITTED, QUEUE_FULL, TIMED_OUT, TOO_LARGE };
+
+    Verdict acquire(size_t bytes) {
+        std::unique_lock<std::mutex> lock(mu);
+        if (bytes>budget) { rejected++; return TOO_LARGE; }
+        auto fits=[&]{ return running<concurrency && mem_used+bytes<=budget; };
+        if (waiting.empty() && fits()) { running++; mem_used+=bytes; return ADMITTED; }
+        if ((int)waiting.size()>=queue_limit) { rejected++; return QUEUE_FULL; }
+        uint64_t me=next_ticket++;
+        waiting.push_back(me);
+        bool ok=turn.wait_for(lock,std::chrono::milliseconds(timeout_ms),[&]{ return waiting.front()==me && fits(); });
+        waiting.erase(std::find(waiting.begin(),waiting.end(),me));
+        turn.notify_all();   // the next ticket may be at the front now
+        if (!ok) { rejected++; return TIMED_OUT; }
+        running++; mem_used+=bytes;
+        return ADMITTED;
+    }
+    void release(size_t bytes, double run_ms) {
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            running--; mem_used-=bytes;
+            if (run_ms>=0) avg_run_ms=0.8*avg_run_ms+0.2*run_ms;   // <0: never ran
+        }
+        turn.notify_all();
+    }
+    // Seconds until the work ahead of a new request should have drained.
+    int retry_after_s() {
+        std::lock_guard<std::mutex> lock(mu);
+        return std::max(1,(int)std::ceil(avg_run_ms/1000.0*(waiting.size()+running)/concurrency));
+    }
+    int queued() { std::lock_guard<std::mutex> lock(mu); return (int)waiting.size(); }
+    size_t memory_in_use() { std::lock_guard<std::mutex> lock(mu); return mem_used; }
+};
+
+AdmissionControl ADMISSION;
+LatencyHistogram QUEUE_TIMES;
+
+// Prometheus text exposition of the counters above.
+std::string metrics_text() {
+    std::ostringstream out;
+    out<<"# HELP analyzer_stage_seconds Pipeline stage time per well (serialize: per run).\n"
+       <<"# TYPE analyzer_stage_seconds histogram\n";
+    for (int st=0;st<STAGE_COUNT;st++)
+        STAGE_TIMES[st].write(out,"analyzer_stage_seconds",std::string("stage=\"")+STAGE_NAMES[st]+"\"");
+    out<<"# HELP analyzer_run_seconds Wall time of a whole plate analysis.\n"
+       <<"# TYPE analyzer_run_seconds histogram\n";
+    RUN_TIMES.write(out,"analyzer_run_seconds","");
+    out<<"# HELP analyzer_runs_total Plate analyses completed.\n# TYPE analyzer_runs_total counter\n"
+       <<"analyzer_runs_total "<<RUNS_TOTAL.load()<<"\n"
+       <<"# HELP analyzer_runs_in_flight Plate analyses running now.\n# TYPE analyzer_runs_in_flight gauge\n"
+       <<"analyzer_runs_in_flight "<<RUNS_IN_FLIGHT.load()<<"\n"
+       <<"# HELP analyzer_http_queue_depth Connections waiting for an HTTP worker.\n# TYPE analyzer_http_queue_depth gauge\n"
+       <<"analyzer_http_queue_depth "<<HTTP_QUEUE_DEPTH.load()<<"\n"
+       <<"# HELP analyzer_analyze_queue_depth Analyses admitted to the queue, waiting to run.\n"
+       <<"# TYPE analyzer_analyze_queue_depth gauge\n"
+       <<"analyzer_analyze_queue_depth "<<ADMISSION.queued()<<"\n"
+       <<"# HELP analyzer_analyze_memory_bytes Estimated working set of running analyses.\n"
+       <<"# TYPE analyzer_analyze_memory_bytes gauge\n"
+       <<"analyzer_analyze_memory_bytes "<<ADMISSION.memory_in_use()<<"\n"
+       <<"# HELP analyzer_analyze_rejected_total Analyses turned away (queue full, timeout, too large).\n"
+       <<"# TYPE analyzer_analyze_rejected_total counter\n"
+       <<"analyzer_analyze_rejected_total "<<ADMISSION.rejected.load()<<"\n"
+       <<"# HELP analyzer_queue_seconds Wait before an admitted analysis started.\n"
+       <<"# TYPE analyzer_queue_seconds histogram\n";
+    QUEUE_TIMES.write(out,"analyzer_queue_seconds","");
+    auto workers=WORKERS.snapshot();
+    auto each=[&](const char* name, const char* type, const char* help, auto value) {
+        out<<"# HELP "<<name<<" "<<help<<"\n# TYPE "<<name<<" "<<type<<"\n";
+        for (const auto& w:workers)
+            out<<name<<"{pool=\""<<w->pool<<"\",worker=\""<<w->index<<"\"} "<<value(*w)<<"\n";
+    };
+    each("analyzer_worker_busy_seconds_total","counter","Time a worker thread spent running jobs.",
+         [](const WorkerStats& w){ return w.busy_ns.load()/1e9; });
+    each("analyzer_worker_jobs_total","counter","Jobs a worker thread ran.",
+         [](const WorkerStats& w){ return w.jobs.load(); });
+    each("analyzer_worker_utilization","gauge","Busy fraction of a worker thread since it started.",
+         [](const WorkerStats& w){ return w.utilization(); });
+    each("analyzer_worker_cpu","gauge","CPU the worker's last job ran on (-1: none yet).",
+         [](const WorkerStats& w){ return w.cpu.load(); });
+    return out.str();
+}
+
+// Live/dead calls for one well's detections; their measurements are appended
+// to `cells` as well `index`.
+std::vector<char> classify_well(const cv::Mat& frame, const std::vector<cv::KeyPoint>& kps, int index,
+                                const AnalysisOptions& opt, const AnalyzerParams& prm, CellTable& cells) {
+    size_t first=cells.size();
+    for (const auto& kp:kps) cells.append(index,kp,measure_cell(frame,kp));
+    classify_cells(cells,first,opt.logistic?&prm.model:nullptr,(float)prm.live_mean_threshold);
+    return std::vector<char>(cells.alive.begin()+first,cells.alive.end());
+}
+
+// Fixed set of worker threads draining a FIFO of jobs. Workers register
+// under `name` in WORKERS (and are pinned when ANALYZER_PIN is set).
+class WorkerPool {
+    std::mutex mu;
+    std::condition_variable wake, done;
+    std::deque<std::function<void()>> jobs;
+    std::vector<std::thread> threads;
+    size_t busy=0;
+    bool stop=false;
+public:
+    explicit WorkerPool(unsigned n, const std::string& name="pool") {
+        for (unsigned t=0;t<std::max(1u,n);t++)
+            threads.emplace_back([this,name]{
+                WorkerSlot slot(name);
+                std::unique_lock<std::mutex> lock(mu);
+                for (;;) {
+                    wake.wait(lock,[this]{ return stop || !jobs.empty(); });
+                    if (jobs.empty()) return;
+                    auto job=std::move(jobs.front());
+                    jobs.pop_front(); busy++;
+                    lock.unlock();
+                    auto t0=std::chrono::steady_clock::now();
+                    job();
+                    slot.stats->record(t0);
+                    lock.lock();
+                    if (!--busy && jobs.empty()) done.notify_all();
+                }
+            });
+    }
+    ~WorkerPool() {   // runs what is still queued, then joins
+        { std::lock_guard<std::mutex> lock(mu); stop=true; }
+        wake.notify_all();
+        for (auto& t:threads) t.join();
+    }
+    size_t size() const { return threads.size(); }
+    void submit(std::function<void()> job) {
+        { std::lock_guard<std::mutex> lock(mu); jobs.push_back(std::move(job)); }
+        wake.notify_one();
+    }
+    void wait() {
+        std::unique_lock<std::mutex> lock(mu);
+        done.wait(lock,[this]{ return jobs.empty() && !busy; });
+    }
+};
+
+// Background thread writing whole files, so workers never block on disk.
+// Producers block once more than `max_bytes` are queued.
+class FileWriter {
+    std::mutex mu;
+    std::condition_variable ready, drained;
+    std::deque<std::pair<std::string,std::string>> files;   // path, contents
+    size_t queued=0, max_bytes;
+    bool stop=false;
+    std::thread thread;
+public:
+    explicit FileWriter(size_t max_bytes=256<<20) : max_bytes(max_bytes), thread([this]{
+        std::unique_lock<std::mutex> lock(mu);
+        for (;;) {
+            ready.wait(lock,[this]{ return stop || !files.empty(); });
+            if (files.empty()) return;
+            auto f=std::move(files.front());
+            files.pop_front();
+            lock.unlock();
+            std::ofstream out(f.first,std::ios::binary);
+            out.write(f.second.data(),f.second.size());
+            if (!out) std::cerr<<"cannot write "<<f.first<<std::endl;
+            lock.lock();
+            queued-=f.second.size();
+            drained.notify_all();
+        }
+    }) {}
+    ~FileWriter() {   // flushes everything queued
+        { std::lock_guard<std::mutex> lock(mu); stop=true; }
+        ready.notify_all();
+        thread.join();
+    }
+    void write(std::string path, std::string contents) {
+        std::unique_lock<std::mutex> lock(mu);
+        drained.wait(lock,[&]{ return queued==0 || queued+contents.size()<=max_bytes; });
+        queued+=contents.size();
+        files.emplace_back(std::move(path),std::move(contents));
+        ready.notify_one();
+    }
+};
+
+// How plate analyses share the cores. Either wells are spread over
+// WELL_POOL with OpenCV single-threaded, or they run one after another and
+// OpenCV's parallel_for uses the cores. Running both stacks one thread per
+// core from each and the two fight over caches. cv::setNumThreads is
+// process-wide, so the plan is fixed at startup for the frame size the
+// deployment expects (ANALYZE_FRAME_SIZE) rather than chosen per run.
+struct ThreadPlan {
+    bool per_well=false;
+    int cv_threads=1;
+    bool automatic=false;   // inputs below are set when plan_threads chose it
+    unsigned cores=1;
+    int concurrent_runs=1, opencv_min_size=0;
+};
+ThreadPlan PLAN;
+std::unique_ptr<WorkerPool> WELL_POOL;
+bool STREAM_DEFAULT=false;   // ANALYZE_STREAM=1: /api/analyze streams unless ?stream=0
+
+// Spreading wells wins while there are enough of them to fill a run's share
+// of the cores and the frames are below the size where OpenCV's own
+// splitting pays off (`opencv_min_size`, see --bench threading).
+ThreadPlan plan_threads(size_t wells, int frame_size, unsigned cores, int concurrent_runs, int opencv_min_size) {
+    ThreadPlan plan;
+    plan.automatic=true;
+    plan.cores=cores; plan.concurrent_runs=concurrent_runs; plan.opencv_min_size=opencv_min_size;
+    unsigned share=std::max(1u,cores/(unsigned)std::max(1,concurrent_runs));
+    if (cores<=1) return plan;
+    plan.per_well=wells>=share && frame_size<opencv_min_size;
+    plan.cv_threads=plan.per_well?1:(int)cores;
+    return plan;
+}
+
+// True when a plate at this frame size lies on the other side of the
+// crossover from the startup plan, i.e. it runs in the slower mode.
+bool plan_mismatch(int frame_size) {
+    if (!PLAN.automatic) return false;
+    return plan_threads(DRUGS.size(),frame_size,PLAN.cores,PLAN.concurrent_runs,PLAN.opencv_min_size).per_well!=PLAN.per_well;
+}
+
+// One well of a plate run, analysed on its own so wells can run on
+// separate threads; run_full_analysis() merges them in well order.
+struct WellOutput {
+    WellResult result;
+    CellTable cells;      // this well's rows only
+    WellMasks masks;      // first_cell is set when merged
+    FramePyramid png;
+    Thumb thumb;
+};
+
+WellOutput analyse_well(int i, unsigned seed, const AnalysisOptions& opt, const AnalyzerParams& prm) {
+    const auto& d=DRUGS[i%DRUGS.size()];
+    WellOutput out;
+    seed_sim(seed);
+    cv::Mat frame;
+    {
+        StageTimer timer(STAGE_GENERATE);
+        frame=acquire_well(d.survival_rate,opt);
+        if (opt.flatfield) frame=correct_frame(frame,*load_calibration(frame.cols,frame.rows));
+    }
+    WellQC qc=measure_quality(frame);
+    std::vector<cv::KeyPoint> kps;
+    {
+        StageTimer timer(STAGE_DETECT);
+        kps=detect_cells(frame,opt,prm);
+    }
+    int alive=0,dead=0;
+    if (opt.masks) {
+        out.masks.height=frame.rows; out.masks.width=frame.cols;
+        out.masks.rle=cell_masks_rle(frame,kps);
+    }
+    std::vector<char> live;
+    {
+        StageTimer timer(STAGE_CLASSIFY);
+        live=classify_well(frame,kps,i,opt,prm,out.cells);
+    }
+    for (char l:live) l?alive++:dead++;
+    int total=alive+dead;
+    double viability=total>0?(100.0*alive/total):0.0;
+    double efficacy=100.0-viability;
+    WellResult& w=out.result;
+    cv::Mat level;
+    {
+        StageTimer timer(STAGE_ANNOTATE);
+        if (opt.vector_overlay) { level=frame; w.overlay=overlay_json(frame,kps,live,d.name,efficacy); }
+        else level=annotate_well(frame,kps,live,d.name,efficacy);
+    }
+    {
+        StageTimer timer(STAGE_ENCODE);
+        // Pyramid built by 2x2 area averaging while the frame is still in cache.
+        // A streamed run keeps no pyramid, so only the inlined level is encoded.
+        int last=opt.stream?opt.frame_level:FRAME_LEVELS-1;
+        for (int l=0;l<=last;l++) {
+            if (l) cv::resize(level,level,cv::Size(level.cols/2,level.rows/2),0,0,cv::INTER_AREA);
+            if (!opt.stream || l==opt.frame_level) cv::imencode(".png",level,out.png[l]);
+        }
+        w.frame_b64=b64(out.png[opt.frame_level]);
+    }
+    w.well_index=i; w.drug_name=d.name; w.drug_category=d.category;
+    w.total_cells=total; w.alive_cells=alive; w.dead_cells=dead;
+    w.viability=viability; w.efficacy=efficacy;
+    w.qc=qc;
+    if (opt.droplets) {
+        auto drops=detect_droplets(frame);
+        w.droplet_stats=droplet_occupancy(drops,kps,live,frame.cols,frame.rows);
+        if (opt.droplets>1) w.droplets=std::move(drops);
+    }
+    cv::Mat small;
+    cv::resize(frame,small,cv::Size(std::max(1,frame.cols/4),std::max(1,frame.rows/4)),0,0,cv::INTER_AREA);
+    Thumb& t=out.thumb;
+    t.width=small.cols; t.height=small.rows; t.px.resize(small.total());
+    for (int y=0;y<small.rows;y++) std::memcpy(&t.px[y*small.cols],small.ptr<uchar>(y),small.cols);
+    return out;
+}
+
+// One well of the /api/analyze response.
+void write_well_json(std::ostream& j, const WellResult& w, const AnalysisOptions& opt) {
+    j<<"    {\"well_index\":"<<w.well_index<<",\"drug\":\""<<w.drug_name
+     <<"\",\"category\":\""<<w.drug_category<<"\",\"total_cells\":"<<w.total_cells
+     <<",\"alive_cells\":"<<w.alive_cells<<",\"dead_cells\":"<<w.dead_cells
+     <<",\"viability\":"<<w.viability<<",\"efficacy\":"<<w.efficacy
+     <<",\"qc\":{\"pass\":"<<(w.qc.pass?"true":"false")<<",\"reason\":\""<<w.qc.reason
+     <<"\",\"focus\":"<<std::setprecision(4)<<w.qc.focus<<",\"saturation\":"<<w.qc.saturation<<std::setprecision(1)
+     <<",\"background\":"<<w.qc.background<<",\"snr\":"<<w.qc.snr<<"}";
+    if (opt.droplets) {
+        const auto& s=w.droplet_stats;
+        j<<",\"droplets\":{\"count\":"<<s.count<<",\"empty\":"<<s.empty<<",\"single\":"<<s.single
+         <<",\"multi\":"<<s.multi<<",\"unassigned_cells\":"<<s.unassigned
+         <<",\"mean_viability\":"<<s.mean_viability<<",\"single_cell_viability\":"<<s.single_viability;
+        if (opt.droplets>1) {
+            j<<",\"list\":[";   // [x, y, r, alive, dead]
+            for (size_t k=0;k<w.droplets.size();k++) {
+                const auto& d=w.droplets[k];
+                j<<(k?",":"")<<"["<<d.x<<","<<d.y<<","<<d.r<<","<<d.alive<<","<<d.dead<<"]";
+            }
+            j<<"]";
+        }
+        j<<"}";
+    }
+    if (!w.overlay.empty()) j<<",\"overlay\":"<<w.overlay;
+    j<<",\"frame_b64\":\""<<w.frame_b64<<"\"}";
+}
+
+// Analyses one plate and hands the response JSON to `emit` in pieces: the run
+// header, every well as soon as it and the wells before it are done, then the
+// ranking, which needs them all. Ranking works on the WellSummary kept per
+// well, so a WellResult with its base64 frame is released once written. With
+// opt.stream at most one well per worker is in flight and frames are not kept
+// for /api/runs/{id}/wells/{w}/frame, so peak memory does not grow with the
+// plate (only summaries, thumbnails and cell rows do). The object is left
+// open for the caller to append fields and close. Returns false, and files
+// nothing, when emit does (client gone).
+bool analyse_plate(const AnalysisOptions& opt, const std::function<bool(const std::string&)>& emit) {
+    auto run=std::make_shared<RunRecord>();
+    run->id=new_run_id();
+    run->patient=opt.patient;
+    run->cohort=opt.cohort;
+    run->timestamp=std::time(nullptr);
+    auto prm=current_params();   // this run's parameters, even if the config is reloaded meanwhile
+    run->params_version=prm->version;
+    RUNS_IN_FLIGHT++;
+    struct InFlight { ~InFlight() { RUNS_IN_FLIGHT--; } } in_flight;
+    auto t_run=std::chrono::steady_clock::now();
+    double serialize_ms=0;
+    auto t_piece=t_run;   // start of the piece being formatted
+    auto send=[&](std::ostringstream& j){
+        std::string piece=j.str();
+        j.str("");
+        serialize_ms+=elapsed_ms(t_piece);   // formatting only, not the socket write
+        return emit(piece);
+    };
     std::ostringstream j;
     j<<std::fixed<<std::setprecision(1);
     j<<"{\n";
-    j<<"  \"best_drug\":\""<<ranked[0]->drug_name<<"\",\n";
-    j<<"  \"best_efficacy\":"<<ranked[0]->efficacy<<",\n";
-    j<<"  \"best_category\":\""<<ranked[0]->drug_category<<"\",\n";
+    j<<"  \"run_id\":\""<<run->id<<"\",\n";
+    j<<"  \"patient\":\""<<run->patient<<"\",\n";
+    j<<"  \"cohort\":\""<<run->cohort<<"\",\n";
+    j<<"  \"z_planes\":"<<opt.z_planes<<",\n";
+    j<<"  \"classifier\":\""<<(opt.logistic && prm->model.loaded?"logistic":"threshold")<<"\",\n";
+    j<<"  \"params_version\":"<<prm->version<<",\n";
+    j<<"  \"streamed\":"<<(opt.stream?"true":"false")<<",\n";
+    j<<"  \"wells\":[\n";
+    if (!send(j)) return false;
+    // Wells are seeded from the run, so the outcome does not depend on which
+    // thread analyses which well.
+    unsigned run_seed=(unsigned)sim_rand();
+    size_t n=DRUGS.size(), next=0;
+    bool pooled=PLAN.per_well && WELL_POOL;
+    size_t window=!pooled?1:opt.stream?WELL_POOL->size():n;
+    std::deque<std::future<WellOutput>> pending;
+    struct Drain {   // pool jobs reference this frame; let them finish on any exit
+        std::deque<std::future<WellOutput>>& p;
+        ~Drain() {
+            for (auto& f:p)
+                if (f.valid() && f.wait_for(std::chrono::seconds(0))!=std::future_status::deferred) f.wait();
+        }
+    } drain{pending};
+    for (size_t k=0;k<n;k++) {
+        for (;next<n && pending.size()<window;next++) {
+            int i=(int)next;
+            if (!pooled) { pending.push_back(std::async(std::launch::deferred,[&,i]{ return analyse_well(i,run_seed+i,opt,*prm); })); continue; }
+            auto task=std::make_shared<std::packaged_task<WellOutput()>>([&,i]{ return analyse_well(i,run_seed+i,opt,*prm); });
+            pending.push_back(task->get_future());
+            WELL_POOL->submit([task]{ (*task)(); });
+        }
+        WellOutput o=pending.front().get();
+        pending.pop_front();
+        const WellResult& w=o.result;
+        if (opt.masks) {
+            o.masks.first_cell=(int)run->cells.size();
+            run->masks.push_back(std::move(o.masks));
+        }
+        run->cells.append(o.cells);
+        run->wells.push_back({w.well_index,w.drug_name,w.drug_category,w.efficacy,w.viability,w.qc.pass});
+        run->frames.push_back(opt.stream?FramePyramid():std::move(o.png));
+        run->thumbs.push_back(std::move(o.thumb));
+        std::cout<<"  Well "<<std::setw(2)<<w.well_index<<" ["<<w.drug_name<<"] efficacy="
+                 <<std::fixed<<std::setprecision(1)<<w.efficacy<<"%"
+                 <<(w.qc.pass?"":" [QC fail: "+w.qc.reason+"]")<<std::endl;
+        t_piece=std::chrono::steady_clock::now();
+        write_well_json(j,w,opt);
+        j<<(k+1<n?",\n":"\n");
+        if (!send(j)) return false;
+    }
+    t_piece=std::chrono::steady_clock::now();
+    std::vector<const WellSummary*> ranked;   // wells failing QC are reported but never ranked
+    for (const auto& w:run->wells) if (w.qc_pass) ranked.push_back(&w);
+    std::sort(ranked.begin(),ranked.end(),[](const WellSummary* a,const WellSummary* b){return a->efficacy>b->efficacy;});
+    WellSummary none{};
+    const WellSummary* best=ranked.empty()?&none:ranked[0];
+    j<<"  ],\n";
     j<<"  \"ranked\":[\n";
-    for (int r=0;r<std::min(5,(int)ranked.size());r++) {
+    int top=std::min(5,(int)ranked.size());
+    for (int r=0;r<top;r++) {
         auto* w=ranked[r];
-        j<<"    {\"rank\":"<<(r+1)<<",\"drug\":\""<<w->drug_name<<"\",\"category\":\""
-         <<w->drug_category<<"\",\"efficacy\":"<<w->efficacy<<",\"viability\":"
+        j<<"    {\"rank\":"<<(r+1)<<",\"drug\":\""<<w->drug<<"\",\"category\":\""
+         <<w->category<<"\",\"efficacy\":"<<w->efficacy<<",\"viability\":"
          <<w->viability<<",\"well_index\":"<<w->well_index<<"}";
-        if(r<4) j<<",";
+        if(r+1<top) j<<",";
         j<<"\n";
     }
     j<<"  ],\n";
-    j<<"  \"wells\":[\n";
-    for (int i=0;i<(int)wells.size();i++) {
-        const auto& w=wells[i];
-        j<<"    {\"well_index\":"<<w.well_index<<",\"drug\":\""<<w.drug_name
-         <<"\",\"category\":\""<<w.drug_category<<"\",\"total_cells\":"<<w.total_cells
-         <<",\"alive_cells\":"<<w.alive_cells<<",\"dead_cells\":"<<w.dead_cells
-         <<",\"viability\":"<<w.viability<<",\"efficacy\":"<<w.efficacy
-         <<",\"frame_b64\":\""<<w.frame_b64<<"\"}";
-        if(i+1<(int)wells.size()) j<<",";
-        j<<"\n";
+    j<<"  \"best_drug\":\""<<best->drug<<"\",\n";
+    j<<"  \"best_efficacy\":"<<best->efficacy<<",\n";
+    j<<"  \"best_category\":\""<<best->category<<"\"";
+    std::ostringstream sum;   // compact summary kept by the run store
+    sum<<std::fixed<<std::setprecision(1)<<"{\"run_id\":\""<<run->id<<"\",\"patient\":\""<<run->patient
+       <<"\",\"cohort\":\""<<run->cohort
+       <<"\",\"timestamp\":"<<run->timestamp<<",\"params_version\":"<<run->params_version<<",\"best_drug\":\""<<best->drug<<"\",\"best_efficacy\":"
+       <<best->efficacy<<",\"best_category\":\""<<best->category<<"\",\"wells\":[";
+    for (size_t i=0;i<run->wells.size();i++) {
+        const auto& w=run->wells[i];
+        sum<<(i?",":"")<<"{\"well_index\":"<<w.well_index<<",\"drug\":\""<<w.drug<<"\",\"category\":\""
+           <<w.category<<"\",\"efficacy\":"<<w.efficacy<<",\"viability\":"<<w.viability
+           <<",\"qc_pass\":"<<(w.qc_pass?"true":"false")<<"}";
+    }
+    sum<<"]}";
+    run->summary=sum.str();
+    if (!send(j)) return false;
+    STAGE_TIMES[STAGE_SERIALIZE].observe(serialize_ms);
+    STORE.add(*run);
+    EFFICACY.add(*run);
+    RUNS.add(run);
+    RUN_TIMES.observe(elapsed_ms(t_run));
+    RUNS_TOTAL++;
+    return true;
+}
+
+std::string run_full_analysis(const AnalysisOptions& opt={}) {
+    std::string json;
+    analyse_plate(opt,[&](const std::string& part){ json+=part; return true; });
+    return json+"\n}";
+}
+
+// False until warm_up() has finished; /api/ready answers 503 until then.
+std::atomic<bool> READY(false);
+
+// Pays the first-run costs before any client does: OpenCV's lazy
+// initialisation and thread pool, PNG codec setup, the calibration and
+// colour tables, and first-touch page faults in each worker's heap. One
+// small synthetic well goes through every optional path, then one plain
+// well runs on every well worker (each waits for the rest, so none takes
+// two) or, without per-well workers, on OpenCV's threads.
+void warm_up() {
+    auto t0=std::chrono::steady_clock::now();
+    try {
+        auto prm=current_params();
+        AnalysisOptions opt;
+        heat_colour(0);
+        load_calibration(opt.frame_size,opt.frame_size);
+        auto well=[&](const AnalysisOptions& o){
+            struct Untimed {   // per thread, and cleared even if the well throws
+                Untimed() { STAGES_UNTIMED=true; }
+                ~Untimed() { STAGES_UNTIMED=false; }
+            } untimed;
+            analyse_well(0,0,o,*prm);
+        };
+        AnalysisOptions full=opt;
+        full.detector=DETECT_LOG; full.flatfield=true; full.declump=true; full.droplets=1; full.masks=true;
+        well(full);
+        if (PLAN.per_well && WELL_POOL) {
+            std::mutex mu;
+            std::condition_variable all_in;
+            size_t arrived=0, n=WELL_POOL->size();
+            std::vector<std::future<void>> done;
+            for (size_t w=0;w<n;w++) {
+                auto task=std::make_shared<std::packaged_task<void()>>([&]{
+                    {
+                        std::unique_lock<std::mutex> lock(mu);
+                        if (++arrived==n) all_in.notify_all();
+                        all_in.wait(lock,[&]{ return arrived==n; });
+                    }
+                    well(opt);
+                });
+                done.push_back(task->get_future());
+                WELL_POOL->submit([task]{ (*task)(); });
+            }
+            for (auto& f:done) f.get();
+        } else well(opt);
+        std::cout<<"Warm-up done in "<<(long)elapsed_ms(t0)<<" ms"<<std::endl;
+    } catch (const std::exception& e) {
+        std::cerr<<"warm-up failed ("<<e.what()<<"), serving cold"<<std::endl;
+    }
+    READY=true;
+}
+
+// Greedy one-to-one matching of detections to ground-truth cells; a detection
+// counts when its centre lies within the cell's radius. Returns, per detection,
+// the index of its truth cell or -1.
+std::vector<int> match_truth(const std::vector<SimCell>& truth, const std::vector<cv::KeyPoint>& kps) {
+    std::vector<int> match(kps.size(),-1);
+    for (size_t c=0;c<truth.size();c++) {
+        int best=-1; double bestd=truth[c].r*truth[c].r;
+        for (size_t k=0;k<kps.size();k++) {
+            if (match[k]>=0) continue;
+            double dx=kps[k].pt.x-truth[c].cx, dy=kps[k].pt.y-truth[c].cy, d2=dx*dx+dy*dy;
+            if (d2<=bestd) { bestd=d2; best=(int)k; }
+        }
+        if (best>=0) match[best]=(int)c;
     }
-    j<<"  ]\n}";
+    return match;
+}
+
+// True positives of match_truth().
+int match_detections(const std::vector<SimCell>& truth, const std::vector<cv::KeyPoint>& kps) {
+    auto match=match_truth(truth,kps);
+    return (int)std::count_if(match.begin(),match.end(),[](int m){ return m>=0; });
+}
+
+// cell_analyzer --bench declump : count accuracy and time of the blob detector
+// with and without declumping, 1024x1024 frames, 25 to 2000 cells per frame.
+int bench_declump() {
+    const int size=1024, reps=5;
+    std::cout<<"cells  | blob: count_err  recall  ms     | +declump: count_err  recall  ms\n";
+    for (int density : {25,50,100,250,500,1000,2000}) {
+        double err[2]={0,0}, recall[2]={0,0}, ms[2]={0,0};
+        for (int rep=0;rep<reps;rep++) {
+            seed_sim(1000*density+rep);
+            cv::Mat frame=background_frame(size,size);
+            auto truth=generate_cells(0.5,size,size,0.0,density);
+            render_cells(frame,truth);
+            auto t0=std::chrono::steady_clock::now();
+            auto kps=detect_blobs(frame);
+            double t_detect=elapsed_ms(t0);
+            t0=std::chrono::steady_clock::now();
+            auto split=declump_cells(frame,kps);
+            double t_declump=elapsed_ms(t0);
+            const std::vector<cv::KeyPoint>* res[2]={&kps,&split};
+            for (int m=0;m<2;m++) {
+                err[m]+=100.0*std::abs((double)res[m]->size()-density)/density;
+                recall[m]+=100.0*match_detections(truth,*res[m])/density;
+            }
+            ms[0]+=t_detect; ms[1]+=t_detect+t_declump;
+        }
+        std::cout<<std::fixed<<std::setprecision(1)<<std::setw(6)<<density<<" | ";
+        for (int m=0;m<2;m++)
+            std::cout<<std::setw(10)<<err[m]/reps<<"%"<<std::setw(7)<<recall[m]/reps<<"%"
+                     <<std::setw(8)<<ms[m]/reps<<"    | ";
+        std::cout<<std::endl;
+    }
+    return 0;
+}
+
+// cell_analyzer --bench flatfield : fused correction kernel vs. the same
+// correction written as consecutive OpenCV calls (rolling-ball opening, or a
+// wide Gaussian, as the background estimate).
+int bench_flatfield() {
+    const int reps=20;
+    std::cout<<"size   | fused ms | opencv+open ms | opencv+gauss ms\n";
+    for (int size : {320,1024,2048}) {
+        seed_sim(size);
+        cv::Mat raw=background_frame(size,size);
+        render_cells(raw,generate_cells(0.5,size,size,0.0,size*size/4000));
+        apply_optics(raw);
+        auto cal=load_calibration(size,size);
+        cv::Mat ball=cv::getStructuringElement(cv::MORPH_ELLIPSE,cv::Size(51,51));
+        double ms[3]={0,0,0};
+        cv::Mat out, f, bg;
+        for (int rep=0;rep<reps;rep++) {
+            auto t0=std::chrono::steady_clock::now();
+            out=correct_frame(raw,*cal);
+            ms[0]+=elapsed_ms(t0);
+            for (int chain=1;chain<=2;chain++) {
+                t0=std::chrono::steady_clock::now();
+                cv::subtract(raw,cal->dark,f,cv::Mat(),CV_32F);
+                cv::multiply(f,cal->gain,f);
+                if (chain==1) cv::morphologyEx(f,bg,cv::MORPH_OPEN,ball);
+                else cv::GaussianBlur(f,bg,cv::Size(0,0),FLAT_TILE/2.0);
+                cv::subtract(f,bg,f);
+                f.convertTo(out,CV_8U,1,FLAT_BG_TARGET);
+                ms[chain]+=elapsed_ms(t0);
+            }
+        }
+        std::cout<<std::fixed<<std::setprecision(2)<<std::setw(6)<<size<<" | "<<std::setw(8)<<ms[0]/reps
+                 <<" | "<<std::setw(14)<<ms[1]/reps<<" | "<<std::setw(15)<<ms[2]/reps<<std::endl;
+    }
+    return 0;
+}
+
+// cell_analyzer --bench log : time, recall and precision of the single-scale
+// blob detector vs. the multi-scale LoG detector on default-density wells.
+int bench_log() {
+    const int reps=20;
+    std::cout<<"size   | blob: ms  recall  precision | log: ms  recall  precision\n";
+    for (int size : {320,640,1024}) {
+        double ms[2]={0,0}, tp[2]={0,0}, det[2]={0,0}, truth_n=0;
+        for (int rep=0;rep<reps;rep++) {
+            seed_sim(size+rep);
+            cv::Mat frame=background_frame(size,size);
+            auto truth=generate_cells(0.5,size,size,0.0,32*size*size/(320*320));
+            render_cells(frame,truth);
+            truth_n+=truth.size();
+            for (int m=0;m<2;m++) {
+                auto t0=std::chrono::steady_clock::now();
+                auto kps=m?detect_log(frame):detect_blobs(frame);
+                ms[m]+=elapsed_ms(t0);
+                tp[m]+=match_detections(truth,kps);
+                det[m]+=kps.size();
+            }
+        }
+        std::cout<<std::fixed<<std::setprecision(1)<<std::setw(6)<<size<<" | ";
+        for (int m=0;m<2;m++)
+            std::cout<<std::setw(8)<<ms[m]/reps<<std::setw(7)<<100*tp[m]/truth_n<<"%"
+                     <<std::setw(10)<<100*tp[m]/std::max(1.0,det[m])<<"% | ";
+        std::cout<<std::endl;
+    }
+    return 0;
+}
+
+// Zero-mean Gaussian sensor noise over the whole frame, cells included.
+void add_noise(cv::Mat& frame, double sd) {
+    cv::Mat noise(frame.size(),CV_16SC1), wide;
+    cv::randn(noise,0,sd);
+    frame.convertTo(wide,CV_16S);
+    wide+=noise;
+    wide.convertTo(frame,CV_8U);
+}
+
+// cell_analyzer --bench accuracy [out.csv] : accuracy against throughput for
+// every detector/classifier configuration (blob or LoG, with and without
+// declumping, threshold or logistic live/dead when CLASSIFIER_MODEL is set).
+// Seeded 320x320 frames sweep density, extra sensor noise and survival; all
+// configurations see the same frames. Reports detection precision/recall,
+// count error, live/dead accuracy on matched cells, viability error and
+// frames/s, one row per sweep point and configuration, plus CSV when a path
+// is given so runs can be compared.
+int bench_accuracy(const std::string& csv_path) {
+    struct Config { std::string name; AnalysisOptions opt; };
+    std::vector<Config> configs;
+    auto prm=current_params();
+    for (Detector det : {DETECT_BLOB,DETECT_LOG})
+        for (bool declump : {false,true})
+            for (bool logistic : {false,true}) {
+                if (logistic && !prm->model.loaded) continue;
+                Config c;
+                c.opt.detector=det; c.opt.declump=declump; c.opt.logistic=logistic;
+                c.name=std::string(det==DETECT_LOG?"log":"blob")+(declump?"+declump":"")+(logistic?"+logistic":"");
+                configs.push_back(c);
+            }
+    const int size=320, reps=8;
+    std::ostringstream csv;
+    csv<<"density,noise,survival,config,frames,precision,recall,count_err_pct,live_acc,viability_err,fps\n";
+    std::cout<<"cells noise surv | config                 | prec%  recall%  count_err%  live_acc%  viab_err  fps\n";
+    struct Acc { double tp=0, det=0, truth=0, count_err=0, live_ok=0, viab_err=0, ms=0; };
+    std::vector<Acc> total(configs.size());
+    for (int density : {16,32,96,256})
+        for (double noise : {0.0,6.0,12.0})
+            for (double survival : {0.2,0.5,0.8}) {
+                std::vector<Acc> acc(configs.size());
+                for (int rep=0;rep<reps;rep++) {
+                    seed_sim(100000*density+1000*(int)noise+100*(int)(survival*10)+rep);
+                    cv::Mat frame=background_frame(size,size);
+                    auto truth=generate_cells(survival,size,size,0.0,density);
+                    render_cells(frame,truth);
+                    if (noise>0) add_noise(frame,noise);
+                    int truth_alive=(int)std::count_if(truth.begin(),truth.end(),[](const SimCell& c){ return c.alive; });
+                    for (size_t c=0;c<configs.size();c++) {
+                        Acc& a=acc[c];
+                        auto t0=std::chrono::steady_clock::now();
+                        auto kps=detect_cells(frame,configs[c].opt,*prm);
+                        CellTable cells;
+                        auto live=classify_well(frame,kps,0,configs[c].opt,*prm,cells);
+                        a.ms+=elapsed_ms(t0);
+                        auto match=match_truth(truth,kps);
+                        for (size_t k=0;k<kps.size();k++) {
+                            if (match[k]<0) continue;
+                            a.tp++;
+                            a.live_ok+=(bool)live[k]==truth[match[k]].alive;
+                        }
+                        int alive=(int)std::count(live.begin(),live.end(),1);
+                        a.det+=kps.size(); a.truth+=truth.size();
+                        a.count_err+=100.0*std::abs((double)kps.size()-truth.size())/truth.size();
+                        a.viab_err+=std::abs(100.0*alive/std::max<size_t>(1,kps.size())-100.0*truth_alive/truth.size());
+                    }
+                }
+                for (size_t c=0;c<configs.size();c++) {
+                    const Acc& a=acc[c];
+                    double prec=100*a.tp/std::max(1.0,a.det), rec=100*a.tp/std::max(1.0,a.truth);
+                    double live_acc=100*a.live_ok/std::max(1.0,a.tp), fps=1000.0*reps/std::max(1e-9,a.ms);
+                    std::cout<<std::fixed<<std::setprecision(1)<<std::setw(5)<<density<<std::setw(6)<<noise
+                             <<std::setw(5)<<survival<<" | "<<std::left<<std::setw(22)<<configs[c].name<<std::right
+                             <<" | "<<std::setw(5)<<prec<<std::setw(9)<<rec<<std::setw(12)<<a.count_err/reps
+                             <<std::setw(11)<<live_acc<<std::setw(10)<<a.viab_err/reps<<std::setw(7)<<fps<<"\n";
+                    csv<<density<<","<<noise<<","<<survival<<","<<configs[c].name<<","<<reps<<","<<prec<<","<<rec<<","
+                       <<a.count_err/reps<<","<<live_acc<<","<<a.viab_err/reps<<","<<fps<<"\n";
+                    Acc& t=total[c];
+                    t.tp+=a.tp; t.det+=a.det; t.truth+=a.truth; t.live_ok+=a.live_ok;
+                    t.count_err+=a.count_err; t.viab_err+=a.viab_err; t.ms+=a.ms;
+                }
+            }
+    int frames=4*3*3*reps;
+    std::cout<<"\nall sweeps            | config                 | prec%  recall%  count_err%  live_acc%  viab_err  fps\n";
+    for (size_t c=0;c<configs.size();c++) {
+        const Acc& t=total[c];
+        std::cout<<std::fixed<<std::setprecision(1)<<std::setw(21)<<frames<<" | "<<std::left<<std::setw(22)
+                 <<configs[c].name<<std::right<<" | "<<std::setw(5)<<100*t.tp/std::max(1.0,t.det)
+                 <<std::setw(9)<<100*t.tp/std::max(1.0,t.truth)<<std::setw(12)<<t.count_err/frames
+                 <<std::setw(11)<<100*t.live_ok/std::max(1.0,t.tp)<<std::setw(10)<<t.viab_err/frames
+                 <<std::setw(7)<<1000.0*frames/std::max(1e-9,t.ms)<<"\n";
+    }
+    std::cout<<std::flush;
+    if (!csv_path.empty()) {
+        std::ofstream out(csv_path);
+        out<<csv.str();
+        if (!out) { std::cerr<<"cannot write "<<csv_path<<std::endl; return 1; }
+        std::cout<<"wrote "<<csv_path<<std::endl;
+    }
+    return 0;
+}
+
+// Allocation counters for --bench stages: every operator new, plus cv::Mat
+// buffers (which bypass operator new) through a counting MatAllocator. Both
+// hooks are compiled only into the benchmark build (-DCELL_ANALYZER_BENCH),
+// the server keeps the stock allocator.
+static std::atomic<bool> ALLOC_TRACKING(false);
+static std::atomic<uint64_t> ALLOC_COUNT(0), ALLOC_BYTES(0);
+
+#ifdef CELL_ANALYZER_BENCH
+static const bool ALLOC_COUNTED=true;
+
+static inline void count_alloc(size_t n) {
+    if (!ALLOC_TRACKING.load(std::memory_order_relaxed)) return;
+    ALLOC_COUNT.fetch_add(1,std::memory_order_relaxed);
+    ALLOC_BYTES.fetch_add(n,std::memory_order_relaxed);
+}
+
+void* operator new(size_t n) {
+    count_alloc(n);
+    if (void* p=std::malloc(n?n:1)) return p;
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+// Forwards to OpenCV's standard allocator; the buffers it creates belong to
+// that allocator, so only allocation passes through here.
+class CountingMatAllocator : public cv::MatAllocator {
+public:
+    cv::UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step,
+                           cv::AccessFlag flags, cv::UMatUsageFlags usage) const override {
+        cv::UMatData* u=cv::Mat::getStdAllocator()->allocate(dims,sizes,type,data,step,flags,usage);
+        if (u && !data) count_alloc(u->size);
+        return u;
+    }
+    bool allocate(cv::UMatData* u, cv::AccessFlag flags, cv::UMatUsageFlags usage) const override {
+        return cv::Mat::getStdAllocator()->allocate(u,flags,usage);
+    }
+    void deallocate(cv::UMatData* u) const override { cv::Mat::getStdAllocator()->deallocate(u); }
+};
+#else
+static const bool ALLOC_COUNTED=false;
+#endif
+
+// cell_analyzer --bench stages [sizes] [threads] : per-stage latency and
+// allocations, e.g. --bench stages 320,1024,2048 1,8 (the defaults are
+// 320,1024,2048 and 1,<cores>; threads is cv::setNumThreads). Each stage runs
+// on the same fixture repeatedly and reports median and p99 (nearest rank)
+// time with allocation count and bytes per call (benchmark build only, "-"
+// otherwise); run_full_analysis runs the
+// whole 20-well plate at that frame size with its log output muted.
+int bench_stages(const std::string& size_list, const std::string& thread_list) {
+    auto parse=[](const std::string& list){
+        std::vector<int> v;
+        std::istringstream in(list);
+        for (std::string item; std::getline(in,item,',');) if (std::atoi(item.c_str())>0) v.push_back(std::atoi(item.c_str()));
+        return v;
+    };
+    auto sizes=parse(size_list.empty()?"320,1024,2048":size_list);
+    auto threads=parse(thread_list.empty()?"1,"+std::to_string(analysis_cores()):thread_list);
+#ifdef CELL_ANALYZER_BENCH
+    static CountingMatAllocator counting;
+    cv::Mat::setDefaultAllocator(&counting);
+#else
+    std::cout<<"(allocation counts need a build with -DCELL_ANALYZER_BENCH)\n";
+#endif
+    std::cout<<"size  threads stage             median_ms   p99_ms    allocs/call   KiB/call\n";
+    for (int size : sizes)
+        for (int nthreads : threads) {
+            cv::setNumThreads(nthreads);
+            seed_sim(size);
+            cv::Mat frame=generate_well_frame(0.5,size,size);
+            auto kps=detect_blobs(frame);
+            std::vector<char> live(kps.size());
+            for (size_t k=0;k<kps.size();k++) live[k]=classify_blob(frame,kps[k]);
+            cv::Mat annotated=annotate_well(frame,kps,live,"Paclitaxel",50.0);
+            std::vector<uchar> png;
+            cv::imencode(".png",annotated,png);
+            AnalysisOptions full;
+            full.frame_size=size;
+            struct Stage { const char* name; std::function<void()> fn; int reps; };
+            int reps=size<=320?100:size<=1024?30:10;
+            const Stage stages[]={
+                {"generate_well_frame",[&]{ generate_well_frame(0.5,size,size); },reps},
+                {"detect_blobs",[&]{ detect_blobs(frame); },reps},
+                {"classify_blob",[&]{ for (const auto& kp:kps) classify_blob(frame,kp); },reps},
+                {"classify_well",[&]{ CellTable t; classify_well(frame,kps,0,full,*current_params(),t); },reps},
+                {"annotate_well",[&]{ annotate_well(frame,kps,live,"Paclitaxel",50.0); },reps},
+                {"imencode_png",[&]{ std::vector<uchar> out; cv::imencode(".png",annotated,out); },reps},
+                {"b64",[&]{ b64(png); },reps},
+                {"run_full_analysis",[&]{
+                    std::streambuf* log=std::cout.rdbuf(nullptr);
+                    run_full_analysis(full);
+                    std::cout.rdbuf(log); std::cout.clear();
+                },std::max(3,reps/10)},
+            };
+            for (const auto& st:stages) {
+                st.fn();   // warm caches and lazily built tables
+                std::vector<double> ms;
+                ALLOC_COUNT=0; ALLOC_BYTES=0;
+                ALLOC_TRACKING=true;
+                for (int r=0;r<st.reps;r++) {
+                    auto t0=std::chrono::steady_clock::now();
+                    st.fn();
+                    ms.push_back(elapsed_ms(t0));
+                }
+                ALLOC_TRACKING=false;
+                std::sort(ms.begin(),ms.end());
+                size_t p99=std::min(ms.size()-1,(size_t)std::ceil(0.99*ms.size())-1);
+                std::cout<<std::fixed<<std::setprecision(3)<<std::setw(5)<<size<<std::setw(8)<<nthreads<<" "
+                         <<std::left<<std::setw(18)<<st.name<<std::right<<std::setw(10)<<ms[ms.size()/2]
+                         <<std::setw(10)<<ms[p99]<<std::setprecision(1);
+                if (ALLOC_COUNTED)
+                    std::cout<<std::setw(14)<<(double)ALLOC_COUNT/st.reps<<std::setw(11)<<ALLOC_BYTES/1024.0/st.reps;
+                else std::cout<<std::setw(14)<<"-"<<std::setw(11)<<"-";
+                std::cout<<std::endl;
+            }
+        }
+#ifdef CELL_ANALYZER_BENCH
+    cv::Mat::setDefaultAllocator(nullptr);
+#endif
+    return 0;
+}
+
+// cell_analyzer --bench threading [sizes] [wells] : one plate analysis per
+// frame size and plate size (defaults 320,1024,2048,4096 and 1,4,20), run
+// both ways ThreadPlan allows on every core: wells in sequence with OpenCV
+// threaded, and wells spread over a worker pool with OpenCV single-threaded.
+// The crossover is the smallest frame at which OpenCV's own threading wins
+// for a full plate; ANALYZE_OPENCV_MIN_SIZE takes that value.
+int bench_threading(const std::string& size_list, const std::string& well_list) {
+    auto parse=[](const std::string& list){
+        std::vector<int> v;
+        std::istringstream in(list);
+        for (std::string item; std::getline(in,item,',');) if (std::atoi(item.c_str())>0) v.push_back(std::atoi(item.c_str()));
+        return v;
+    };
+    auto sizes=parse(size_list.empty()?"320,1024,2048,4096":size_list);
+    auto plates=parse(well_list.empty()?"1,4,20":well_list);
+    unsigned cores=analysis_cores();
+    auto prm=current_params();
+    std::cout<<cores<<" cores\n wells  size   opencv_ms   wells_ms  winner\n";
+    std::map<int,int> crossover;   // plate size -> first frame size where OpenCV wins
+    for (int wells:plates)
+        for (int size:sizes) {
+            AnalysisOptions opt;
+            opt.frame_size=size;
+            auto plate=[&](bool per_well){
+                auto t0=std::chrono::steady_clock::now();
+                if (per_well) {
+                    cv::setNumThreads(1);
+                    WorkerPool pool(cores,"bench");
+                    for (int i=0;i<wells;i++) pool.submit([&,i]{ analyse_well(i,i,opt,*prm); });
+                    pool.wait();
+                } else {
+                    cv::setNumThreads((int)cores);
+                    for (int i=0;i<wells;i++) analyse_well(i,i,opt,*prm);
+                }
+                return elapsed_ms(t0);
+            };
+            plate(false);   // warm caches, OpenCV's pool and lazily built tables
+            int reps=size<=1024?3:1;
+            double ms[2]={1e300,1e300};
+            for (int r=0;r<reps;r++)
+                for (int mode=0;mode<2;mode++) ms[mode]=std::min(ms[mode],plate(mode==1));
+            bool opencv=ms[0]<ms[1];
+            if (opencv && !crossover.count(wells)) crossover[wells]=size;
+            std::cout<<std::fixed<<std::setprecision(1)<<std::setw(6)<<wells<<std::setw(6)<<size
+                     <<std::setw(12)<<ms[0]<<std::setw(11)<<ms[1]<<"  "<<(opencv?"opencv":"wells")<<std::endl;
+        }
+    for (int wells:plates)
+        std::cout<<wells<<"-well plate: "<<(crossover.count(wells)?"OpenCV threading from "+std::to_string(crossover[wells])+" px"
+                                                                  :"spread wells at every size")<<"\n";
+    cv::setNumThreads(-1);
+    return 0;
+}
+
+// cell_analyzer --bench index : build the efficacy index from 100k synthetic
+// runs (20 drugs, 4 cohorts), then time the /api/drugs queries against it.
+int bench_index() {
+    const int runs=100000, reps=20;
+    const char* cohorts[]={"breast","lung","colon","ovarian"};
+    EfficacyIndex index;
+    std::vector<std::string> names;
+    for (const auto& d:DRUGS) names.push_back(d.name);
+    seed_sim(39);
+    auto t0=std::chrono::steady_clock::now();
+    for (int r=0;r<runs;r++) {
+        RunRecord run;
+        run.id="bench-"+std::to_string(r); run.cohort=cohorts[r%4];
+        for (size_t d=0;d<DRUGS.size();d++) {
+            double e=100*(1-DRUGS[d].survival_rate)+10.0*(2.0*sim_rand()/RAND_MAX-1.0);
+            run.wells.push_back({(int)d,DRUGS[d].name,DRUGS[d].category,std::max(0.0,std::min(100.0,e)),100-e,true});
+        }
+        index.add(run);
+    }
+    std::cout<<std::fixed<<std::setprecision(2)<<"built "<<runs<<" runs x "<<DRUGS.size()
+             <<" drugs in "<<elapsed_ms(t0)<<" ms\n";
+    std::cout<<"cohort   | all drugs ranked ms | one drug + percentile ms\n";
+    for (std::string cohort : {"breast",""}) {
+        double ms[2]={0,0};
+        for (int rep=0;rep<reps;rep++) {
+            t0=std::chrono::steady_clock::now();
+            index.query(names,cohort);
+            ms[0]+=elapsed_ms(t0);
+            t0=std::chrono::steady_clock::now();
+            index.query({names[0]},cohort,{80.0});
+            ms[1]+=elapsed_ms(t0);
+        }
+        std::cout<<std::setw(8)<<(cohort.empty()?"(all)":cohort)<<" | "<<std::setw(19)<<ms[0]/reps
+                 <<" | "<<std::setw(24)<<ms[1]/reps<<std::endl;
+    }
+    return 0;
+}
+
+// cell_analyzer --batch <image dir | seeds:FIRST-LAST> --out <dir> [--threads N]
+//               [--detector log] [--classifier logistic] [--declump] [--flatfield] [--size N]
+// Offline analysis without the server. Every well image in the directory (or
+// every seed, simulated as well DRUGS[seed % 20]) is one job on a worker pool;
+// annotated frames, per-well cell tables and results.csv reach the disk
+// through a FileWriter. OpenCV's own threading is turned off, the pool
+// already keeps every core busy.
+int run_batch(int argc, char** argv) {
+    std::string input, out_dir;
+    unsigned threads=analysis_cores();
+    AnalysisOptions opt;
+    for (int a=1;a<argc;a++) {
+        std::string key=argv[a], val=a+1<argc?argv[a+1]:"";
+        bool flag=key=="--declump" || key=="--flatfield";
+        if (!flag && a+1>=argc) { std::cerr<<key<<" needs a value"<<std::endl; return 1; }
+        if (key=="--batch") input=val;
+        else if (key=="--out") out_dir=val;
+        else if (key=="--threads") threads=std::max(1,std::atoi(val.c_str()));
+        else if (key=="--detector") opt.detector=val=="log"?DETECT_LOG:DETECT_BLOB;
+        else if (key=="--classifier") opt.logistic=val=="logistic";
+        else if (key=="--size") opt.frame_size=std::max(160,std::min(8192,std::atoi(val.c_str())));
+        else if (key=="--declump") opt.declump=true;
+        else if (key=="--flatfield") opt.flatfield=true;
+        else { std::cerr<<"unknown batch option: "<<key<<std::endl; return 1; }
+        if (!flag) a++;
+    }
+    if (input.empty() || out_dir.empty()) {
+        std::cerr<<"usage: cell_analyzer --batch <image dir | seeds:FIRST-LAST> --out <dir> [options]"<<std::endl;
+        return 1;
+    }
+    struct Job { std::string name, path; int seed; };
+    std::vector<Job> jobs;
+    std::error_code ec;
+    if (input.rfind("seeds:",0)==0) {
+        int first=0, last=-1;
+        std::sscanf(input.c_str()+6,"%d-%d",&first,&last);
+        for (int seed=first;seed<=last;seed++) jobs.push_back({"seed-"+std::to_string(seed),"",seed});
+    } else {
+        for (const auto& e:std::filesystem::directory_iterator(input,ec)) {
+            std::string ext=e.path().extension().string();
+            std::transform(ext.begin(),ext.end(),ext.begin(),::tolower);
+            if (ext==".png" || ext==".tif" || ext==".tiff" || ext==".jpg" || ext==".jpeg" || ext==".bmp")
+                jobs.push_back({e.path().stem().string(),e.path().string(),-1});
+        }
+        std::sort(jobs.begin(),jobs.end(),[](const Job& a,const Job& b){ return a.name<b.name; });
+    }
+    if (jobs.empty()) { std::cerr<<"nothing to analyse in "<<input<<std::endl; return 1; }
+    std::filesystem::create_directories(out_dir+"/frames",ec);
+    std::filesystem::create_directories(out_dir+"/cells",ec);
+    if (ec) { std::cerr<<"cannot create "<<out_dir<<": "<<ec.message()<<std::endl; return 1; }
+    cv::setNumThreads(1);
+    auto prm=current_params();
+    std::vector<std::string> rows(jobs.size());
+    std::atomic<long> cells_total(0);
+    std::atomic<int> failed(0);
+    std::ostringstream usage;
+    usage<<std::fixed;
+    auto t0=std::chrono::steady_clock::now();
+    {
+        FileWriter writer;
+        WorkerPool pool(threads,"batch");
+        for (size_t n=0;n<jobs.size();n++)
+            pool.submit([&,n]{
+                const Job& job=jobs[n];
+                auto w0=std::chrono::steady_clock::now();
+                cv::Mat frame;
+                std::string drug=job.name;
+                if (job.seed>=0) {
+                    const auto& d=DRUGS[job.seed%DRUGS.size()];
+                    seed_sim(job.seed);
+                    frame=acquire_well(d.survival_rate,opt);
+                    drug=d.name;
+                } else frame=cv::imread(job.path,cv::IMREAD_GRAYSCALE);
+                if (frame.empty()) { failed++; rows[n]=job.name+",,,,,,,unreadable,,,"; return; }
+                if (opt.flatfield) frame=correct_frame(frame,*load_calibration(frame.cols,frame.rows));
+                WellQC qc=measure_quality(frame);
+                auto kps=detect_cells(frame,opt,*prm);
+                CellTable cells;
+                auto live=classify_well(frame,kps,(int)n,opt,*prm,cells);
+                int alive=(int)std::count(live.begin(),live.end(),1), total=(int)live.size();
+                double viability=total>0?(100.0*alive/total):0.0;
+                std::vector<uchar> png;
+                cv::imencode(".png",annotate_well(frame,kps,live,drug,100.0-viability),png);
+                writer.write(out_dir+"/frames/"+job.name+".png",std::string(png.begin(),png.end()));
+                writer.write(out_dir+"/cells/"+job.name+".csv",cells_csv(cells));
+                std::ostringstream row;
+                row<<std::fixed<<std::setprecision(1)<<job.name<<","<<drug<<","<<total<<","<<alive<<","
+                   <<total-alive<<","<<viability<<","<<qc.pass<<","<<qc.reason<<","<<std::setprecision(4)<<qc.focus<<std::setprecision(1)<<","
+                   <<qc.snr<<","<<elapsed_ms(w0);
+                rows[n]=row.str();
+                cells_total+=total;
+            });
+        pool.wait();
+        for (const auto& w:WORKERS.snapshot())
+            if (w->pool=="batch")
+                usage<<"  worker "<<w->index<<" on cpu "<<w->cpu<<": "<<std::setprecision(0)<<100*w->utilization()
+                     <<"% busy, "<<w->jobs<<" wells\n";
+        std::string csv="well,drug,total_cells,alive_cells,dead_cells,viability,qc_pass,qc_reason,focus,snr,ms\n";
+        for (const auto& r:rows) csv+=r+"\n";
+        writer.write(out_dir+"/results.csv",std::move(csv));
+    }   // writer drains here, so the time below includes the disk
+    double ms=elapsed_ms(t0);
+    std::cout<<std::fixed<<std::setprecision(1)<<jobs.size()<<" wells, "<<cells_total<<" cells on "<<threads
+             <<" threads in "<<ms/1000<<" s: "<<1000.0*jobs.size()/ms<<" wells/s";
+    if (failed) std::cout<<", "<<failed<<" unreadable";
+    std::cout<<"\n"<<usage.str()<<"wrote "<<out_dir<<"/results.csv"<<std::endl;
+    return failed?2:0;
+}
+
+// Labelled synthetic frame: the image plus the cells it was drawn from.
+struct LabelledFrame {
+    uint64_t seed=0;
+    float survival=0, gain=1;
+    cv::Mat frame;
+    std::vector<SimCell> cells;
+};
+
+// Frame `seed` of the synthetic corpus. Survival (0.05-0.95) and exposure
+// gain (0.5-1.5) are drawn from the seed; density stays at the default
+// 25-39 cells per 320x320 field at any size.
+LabelledFrame synth_frame(uint64_t seed, int size) {
+    LabelledFrame f;
+    seed_sim((unsigned)seed);
+    f.seed=seed;
+    f.survival=0.05f+0.9f*sim_rand()/RAND_MAX;
+    f.gain=0.5f+(float)sim_rand()/RAND_MAX;
+    f.frame=background_frame(size,size);
+    f.cells=generate_cells(f.survival,size,size,0.0,size>320?(25+sim_rand()%15)*size*size/(320*320):0);
+    render_cells(f.frame,f.cells);
+    f.frame.convertTo(f.frame,-1,f.gain);
+    return f;
+}
+
+// Labelled frame shards, <dir>/shard-NNNNN.lds, little-endian:
+//   char magic[8] = "LOCLDS01"; then records up to end of file:
+//   uint64 seed; float32 survival, gain; uint16 width, height; uint32 cells;
+//   per cell: float32 cx, cy, r, z; uint8 intensity (before gain), alive; uint16 0;
+//   uint32 PNG bytes; PNG (zlib level 1)
+// <dir>/manifest.json lists the shards with their frame and seed ranges.
+static const char SHARD_MAGIC[8] = {'L','O','C','L','D','S','0','1'};
+
+void append_labelled(std::string& out, const LabelledFrame& f) {
+    auto put=[&](const auto& v){ out.append((const char*)&v,sizeof v); };
+    std::vector<uchar> png;
+    cv::imencode(".png",f.frame,png,{cv::IMWRITE_PNG_COMPRESSION,1});
+    put(f.seed); put(f.survival); put(f.gain);
+    put((uint16_t)f.frame.cols); put((uint16_t)f.frame.rows); put((uint32_t)f.cells.size());
+    for (const auto& c:f.cells) {
+        put((float)c.cx); put((float)c.cy); put((float)c.r); put((float)c.z);
+        put((uint8_t)c.intensity); put((uint8_t)c.alive); put((uint16_t)0);
+    }
+    put((uint32_t)png.size());
+    out.append((const char*)png.data(),png.size());
+}
+
+// Calls fn for every frame of one shard; false when the file is not a shard
+// or ends in a torn record.
+bool read_shard(const std::string& path, const std::function<void(const LabelledFrame&)>& fn) {
+    std::ifstream in(path,std::ios::binary);
+    char magic[8];
+    if (!in.read(magic,8) || std::memcmp(magic,SHARD_MAGIC,8)) return false;
+    auto get=[&](auto& v){ return (bool)in.read((char*)&v,sizeof v); };
+    LabelledFrame f;
+    while (get(f.seed)) {
+        uint16_t w=0, h=0, pad;
+        uint32_t n=0, bytes=0;
+        if (!(get(f.survival) && get(f.gain) && get(w) && get(h) && get(n))) return false;
+        f.cells.resize(n);
+        for (auto& c:f.cells) {
+            float cx, cy, r, z; uint8_t intensity, alive;
+            if (!(get(cx) && get(cy) && get(r) && get(z) && get(intensity) && get(alive) && get(pad))) return false;
+            c={cx,cy,r,z,intensity,(bool)alive};
+        }
+        if (!get(bytes)) return false;
+        std::vector<uchar> png(bytes);
+        if (!in.read((char*)png.data(),bytes)) return false;
+        f.frame=cv::imdecode(png,cv::IMREAD_GRAYSCALE);
+        if (f.frame.cols!=w || f.frame.rows!=h) return false;
+        fn(f);
+    }
+    return true;
+}
+
+// cell_analyzer --generate-dataset <dir> [--frames N] [--shards S] [--threads T] [--size W] [--seed B]
+// Writes frames B .. B+N-1 (see synth_frame) into S shards of consecutive
+// frames. Each worker builds whole shards and streams them through its own
+// large buffer, so shards are written sequentially and in parallel with no
+// shared lock; the same seeds give the same corpus whatever S and T are.
+int generate_dataset(int argc, char** argv) {
+    std::string dir=argv[2];
+    long frames=10000, shards=0;
+    uint64_t base=0;
+    int size=320;
+    unsigned threads=analysis_cores();
+    for (int a=3;a+1<argc;a+=2) {
+        std::string key=argv[a], val=argv[a+1];
+        if (key=="--frames") frames=std::max(1L,std::atol(val.c_str()));
+        else if (key=="--shards") shards=std::max(1L,std::atol(val.c_str()));
+        else if (key=="--threads") threads=std::max(1,std::atoi(val.c_str()));
+        else if (key=="--size") size=std::max(160,std::min(8192,std::atoi(val.c_str())));
+        else if (key=="--seed") base=std::strtoull(val.c_str(),nullptr,10);
+        else { std::cerr<<"unknown dataset option: "<<key<<std::endl; return 1; }
+    }
+    if (!shards) shards=std::max<long>(threads*4,(frames+9999)/10000);   // ~10k frames per shard
+    shards=std::min(shards,frames);
+    std::error_code ec;
+    std::filesystem::create_directories(dir,ec);
+    if (ec) { std::cerr<<"cannot create "<<dir<<": "<<ec.message()<<std::endl; return 1; }
+    cv::setNumThreads(1);
+    std::atomic<uint64_t> bytes(0);
+    std::atomic<long> done(0);
+    std::atomic<int> failed(0);
+    auto t0=std::chrono::steady_clock::now();
+    {
+        WorkerPool pool(threads,"dataset");
+        for (long sh=0;sh<shards;sh++)
+            pool.submit([&,sh]{
+                char name[32];
+                std::snprintf(name,sizeof(name),"/shard-%05ld.lds",sh);
+                std::vector<char> buf(4<<20);
+                std::ofstream out;
+                out.rdbuf()->pubsetbuf(buf.data(),buf.size());
+                out.open(dir+name,std::ios::binary|std::ios::trunc);
+                out.write(SHARD_MAGIC,8);
+                std::string rec;
+                for (long i=frames*sh/shards;i<frames*(sh+1)/shards;i++) {
+                    rec.clear();
+                    append_labelled(rec,synth_frame(base+i,size));
+                    out.write(rec.data(),rec.size());
+                    bytes+=rec.size();
+                    if (++done%10000==0) std::cout<<"  "<<done<<" frames"<<std::endl;
+                }
+                out.close();
+                if (!out) { std::cerr<<"write failed: "<<dir<<name<<std::endl; failed++; }
+            });
+    }
+    double ms=elapsed_ms(t0);
+    std::ofstream manifest(dir+"/manifest.json");
+    manifest<<"{\"format\":\"LOCLDS01\",\"frames\":"<<frames<<",\"size\":"<<size<<",\"first_seed\":"<<base
+            <<",\"shards\":[";
+    for (long sh=0;sh<shards;sh++) {
+        char name[32];
+        std::snprintf(name,sizeof(name),"shard-%05ld.lds",sh);
+        manifest<<(sh?",":"")<<"{\"file\":\""<<name<<"\",\"first_frame\":"<<frames*sh/shards
+                <<",\"frames\":"<<frames*(sh+1)/shards-frames*sh/shards<<"}";
+    }
+    manifest<<"]}\n";
+    std::cout<<std::fixed<<std::setprecision(1)<<frames<<" frames in "<<shards<<" shards, "<<bytes/1e6<<" MB in "
+             <<ms/1000<<" s: "<<1000.0*frames/ms<<" frames/s, "<<bytes/1e3/ms<<" MB/s on "<<threads<<" threads"<<std::endl;
+    return failed?2:0;
+}
+
+// cell_analyzer --train-classifier <model> [frames | dataset dir] : fit the
+// logistic live/dead model on labelled frames, either `frames` fresh
+// synth_frame()s or every frame of a --generate-dataset corpus. Exposure
+// varies per frame so the model cannot lean on absolute brightness alone;
+// detections are labelled through match_truth() and unmatched ones dropped.
+// Fitted by Newton-Raphson (IRLS) on standardised features with a small ridge.
+int train_classifier(const std::string& path, const std::string& source) {
+    const int F=CLASSIFIER_FEATURES, P=F+1;
+    std::vector<std::array<double,F>> X;
+    std::vector<int> Y;
+    long frames=0;
+    auto add=[&](const LabelledFrame& lf){
+        auto kps=detect_blobs(lf.frame);
+        auto match=match_truth(lf.cells,kps);
+        for (size_t k=0;k<kps.size();k++) {
+            if (match[k]<0) continue;
+            CellFeatures f=measure_cell(lf.frame,kps[k]);
+            X.push_back({f.mean,f.max,f.area,f.ring,f.texture});
+            Y.push_back(lf.cells[match[k]].alive);
+        }
+        frames++;
+    };
+    std::error_code ec;
+    if (std::filesystem::is_directory(source,ec)) {
+        std::vector<std::string> shards;
+        for (const auto& e:std::filesystem::directory_iterator(source,ec))
+            if (e.path().extension()==".lds") shards.push_back(e.path().string());
+        std::sort(shards.begin(),shards.end());
+        for (const auto& sh:shards) if (!read_shard(sh,add)) std::cerr<<"skipping rest of "<<sh<<std::endl;
+    } else {
+        long n=std::max(1L,std::atol(source.c_str()));
+        for (long i=0;i<n;i++) add(synth_frame(4242+i,320));
+    }
+    if (X.empty()) { std::cerr<<"no labelled cells"<<std::endl; return 1; }
+    double mu[F]={}, sd[F]={};
+    for (const auto& x:X) for (int f=0;f<F;f++) mu[f]+=x[f]/X.size();
+    for (const auto& x:X) for (int f=0;f<F;f++) sd[f]+=(x[f]-mu[f])*(x[f]-mu[f])/X.size();
+    for (int f=0;f<F;f++) sd[f]=std::max(1e-6,std::sqrt(sd[f]));
+    double beta[P]={};   // w[0..F-1], bias
+    for (int it=0;it<25;it++) {
+        double H[P][P+1]={};   // Hessian augmented with the gradient
+        for (size_t i=0;i<X.size();i++) {
+            double z[P];
+            for (int f=0;f<F;f++) z[f]=(X[i][f]-mu[f])/sd[f];
+            z[F]=1;
+            double logit=0;
+            for (int a=0;a<P;a++) logit+=beta[a]*z[a];
+            double p=1/(1+std::exp(-logit)), wt=p*(1-p);
+            for (int a=0;a<P;a++) {
+                for (int b=0;b<P;b++) H[a][b]+=wt*z[a]*z[b];
+                H[a][P]+=(Y[i]-p)*z[a];
+            }
+        }
+        for (int a=0;a<F;a++) { H[a][a]+=1e-3*X.size(); H[a][P]-=1e-3*X.size()*beta[a]; }
+        for (int c=0;c<P;c++) {   // Gauss-Jordan with partial pivoting
+            int piv=c;
+            for (int r=c+1;r<P;r++) if (std::abs(H[r][c])>std::abs(H[piv][c])) piv=r;
+            for (int k=0;k<=P;k++) std::swap(H[c][k],H[piv][k]);
+            if (std::abs(H[c][c])<1e-12) continue;
+            for (int r=0;r<P;r++) {
+                if (r==c) continue;
+                double m=H[r][c]/H[c][c];
+                for (int k=c;k<=P;k++) H[r][k]-=m*H[c][k];
+            }
+        }
+        double step=0;
+        for (int a=0;a<P;a++) {
+            double d=std::abs(H[a][a])<1e-12?0:H[a][P]/H[a][a];
+            beta[a]+=d; step=std::max(step,std::abs(d));
+        }
+        if (step<1e-6) break;
+    }
+    int hit_model=0, hit_threshold=0;
+    for (size_t i=0;i<X.size();i++) {
+        double logit=beta[F];
+        for (int f=0;f<F;f++) logit+=beta[f]*(X[i][f]-mu[f])/sd[f];
+        hit_model+=(logit>0)==(bool)Y[i];
+        hit_threshold+=(X[i][0]>LIVE_MEAN_THRESHOLD)==(bool)Y[i];
+    }
+    std::ofstream out(path);
+    if (!out) { std::cerr<<"cannot write "<<path<<std::endl; return 1; }
+    out<<"# live/dead logistic model: mean max area ring texture\n"<<std::setprecision(9);
+    const char* rows[]={"mu","sd","w"};
+    const double* vals[]={mu,sd,beta};
+    for (int r=0;r<3;r++) {
+        out<<rows[r];
+        for (int f=0;f<F;f++) out<<" "<<vals[r][f];
+        out<<"\n";
+    }
+    out<<"b "<<beta[F]<<"\n";
+    std::cout<<std::fixed<<std::setprecision(1)<<X.size()<<" cells from "<<frames<<" frames; training accuracy "
+             <<100.0*hit_model/X.size()<<"% (mean threshold "<<100.0*hit_threshold/X.size()<<"%)\nwrote "<<path<<std::endl;
+    return 0;
+}
+
+// Patient and cohort ids are filed and echoed verbatim; keep them JSON/URL safe.
+std::string safe_id(const std::string& raw) {
+    std::string id;
+    for (char c:raw)
+        if ((std::isalnum((unsigned char)c) || c=='-' || c=='_' || c=='.') && id.size()<64) id+=c;
+    return id;
+}
+
+std::string drug_stats_json(const DrugStats& st) {
+    std::ostringstream j;
+    j<<std::fixed<<std::setprecision(1)<<"{\"drug\":\""<<st.drug<<"\",\"runs\":"<<st.n
+     <<",\"mean_efficacy\":"<<st.mean<<",\"median_efficacy\":"<<st.median;
+    if (st.percentile>=0) j<<",\"percentile_rank\":"<<st.percentile;
+    j<<"}";
     return j.str();
 }
 
-int main() {
-    std::srand(std::time(nullptr));
+int main(int argc, char** argv) {
+    if (argc>1 && std::string(argv[1])=="--health") {   // Docker HEALTHCHECK; the image has no curl
+        httplib::Client cli("127.0.0.1",std::getenv("PORT")?std::atoi(std::getenv("PORT")):8081);
+        cli.set_connection_timeout(2);
+        auto r=cli.Get("/api/ready");
+        return r && r->status==200?0:1;
+    }
+    configure_cpus();
+    const char* config=std::getenv("ANALYZER_CONFIG");
+    if (auto prm=load_params(config?config:"")) {
+        std::atomic_store(&PARAMS,std::shared_ptr<const AnalyzerParams>(std::move(prm)));
+        if (PARAMS->model.loaded) std::cout<<"Loaded live/dead model "<<PARAMS->model_path<<std::endl;
+    } else {   // still honour CLASSIFIER_MODEL when the config file is bad
+        std::cerr<<"using built-in parameters"<<std::endl;
+        if (config && *config) {
+            std::atomic_store(&PARAMS,std::shared_ptr<const AnalyzerParams>(load_params("")));
+            if (PARAMS->model.loaded) std::cout<<"Loaded live/dead model "<<PARAMS->model_path<<std::endl;
+        }
+    }
+    if (argc>2 && std::string(argv[1])=="--bench") {
+        std::string which=argv[2];
+        if (which=="declump") return bench_declump();
+        if (which=="flatfield") return bench_flatfield();
+        if (which=="log") return bench_log();
+        if (which=="index") return bench_index();
+        if (which=="accuracy") return bench_accuracy(argc>3?argv[3]:"");
+        if (which=="stages") return bench_stages(argc>3?argv[3]:"",argc>4?argv[4]:"");
+        if (which=="threading") return bench_threading(argc>3?argv[3]:"",argc>4?argv[4]:"");
+        std::cerr<<"unknown benchmark: "<<which<<std::endl;
+        return 1;
+    }
+    if (argc>2 && std::string(argv[1])=="--train-classifier")
+        return train_classifier(argv[2],argc>3?argv[3]:"200");
+    if (argc>2 && std::string(argv[1])=="--generate-dataset") return generate_dataset(argc,argv);
+    if (argc>1 && std::string(argv[1])=="--batch") return run_batch(argc,argv);
+    seed_sim(std::time(nullptr));
+    if (config) watch_params(config);
+    auto env_int=[](const char* name, long fallback){ const char* v=std::getenv(name); return v?std::atol(v):fallback; };
+    ADMISSION.concurrency=(int)std::max(1L,env_int("ANALYZE_CONCURRENCY",std::max(1u,analysis_cores()/2)));
+    ADMISSION.queue_limit=(int)std::max(0L,env_int("ANALYZE_QUEUE",8));
+    ADMISSION.timeout_ms=(int)std::max(0L,env_int("ANALYZE_QUEUE_TIMEOUT_S",30))*1000;
+    ADMISSION.budget=(size_t)std::max(16L,env_int("ANALYZE_MEMORY_MB",1024))<<20;
+    unsigned cores=analysis_cores();
+    std::string parallel=std::getenv("ANALYZE_PARALLEL")?std::getenv("ANALYZE_PARALLEL"):"auto";
+    PLAN=plan_threads(DRUGS.size(),(int)env_int("ANALYZE_FRAME_SIZE",AnalysisOptions().frame_size),cores,
+                      ADMISSION.concurrency,(int)env_int("ANALYZE_OPENCV_MIN_SIZE",4096));
+    if (parallel=="wells") { PLAN=ThreadPlan(); PLAN.per_well=cores>1; PLAN.cv_threads=cores>1?1:(int)cores; }
+    else if (parallel=="opencv") { PLAN=ThreadPlan(); PLAN.cv_threads=(int)cores; }
+    cv::setNumThreads(PLAN.cv_threads);
+    if (PLAN.per_well) WELL_POOL=std::make_unique<WorkerPool>(cores,"wells");
+    STREAM_DEFAULT=env_int("ANALYZE_STREAM",0)!=0;
+    std::cout<<"Threading: "<<(PLAN.per_well?"wells on "+std::to_string(cores)+" workers, OpenCV single-threaded"
+                                           :"wells in sequence, OpenCV on "+std::to_string(PLAN.cv_threads)+" threads")<<std::endl;
+    const char* store_dir=std::getenv("RUN_STORE_DIR");
+    if (!STORE.open(store_dir?store_dir:"runs")) std::cerr<<"run store unavailable, runs are kept in memory only"<<std::endl;
+    STORE.scan([](const RunRecord& run){ EFFICACY.add(run); });
     httplib::Server server;
+    server.new_task_queue=[]{ return new MeteredTaskQueue(); };
     server.set_default_headers({
         {"Access-Control-Allow-Origin","*"},
         {"Access-Control-Allow-Methods","GET, OPTIONS"},
         {"Access-Control-Allow-Headers","Content-Type"},
     });
-    server.Get("/api/analyze",[](const httplib::Request&,httplib::Response& res){
+    server.Get("/api/analyze",[](const httplib::Request& req,httplib::Response& res){
+        AnalysisOptions opt;
+        if (req.has_param("zplanes"))
+            opt.z_planes=std::max(1,std::min(32,std::atoi(req.get_param_value("zplanes").c_str())));
+        if (req.has_param("droplets"))
+            opt.droplets=req.get_param_value("droplets")=="list"?2:(req.get_param_value("droplets")!="0");
+        if (req.has_param("detector"))
+            opt.detector=req.get_param_value("detector")=="log"?DETECT_LOG:DETECT_BLOB;
+        if (req.has_param("declump"))
+            opt.declump=req.get_param_value("declump")!="0";
+        if (req.has_param("flatfield"))
+            opt.flatfield=req.get_param_value("flatfield")!="0";
+        if (req.has_param("overlay"))
+            opt.vector_overlay=req.get_param_value("overlay")=="vector";
+        if (req.has_param("frame_level"))
+            opt.frame_level=std::max(0,std::min(FRAME_LEVELS-1,std::atoi(req.get_param_value("frame_level").c_str())));
+        if (req.has_param("masks"))
+            opt.masks=req.get_param_value("masks")!="0";
+        if (req.has_param("classifier"))
+            opt.logistic=req.get_param_value("classifier")=="logistic";
+        opt.patient=safe_id(req.get_param_value("patient"));
+        opt.cohort=safe_id(req.get_param_value("cohort"));
+        if (req.has_param("size"))
+            opt.frame_size=std::max(160,std::min(8192,std::atoi(req.get_param_value("size").c_str())));
+        opt.stream=req.has_param("stream")?req.get_param_value("stream")!="0":STREAM_DEFAULT;
         std::cout<<"\nRunning 20-well oncology analysis..."<<std::endl;
-        std::string json=run_full_analysis();
+        if (plan_mismatch(opt.frame_size))
+            std::cerr<<"size="<<opt.frame_size<<" is on the other side of the threading crossover, running with "
+                     <<(PLAN.per_well?"wells in parallel":"OpenCV threads")<<" anyway (see ANALYZE_FRAME_SIZE)"<<std::endl;
+        size_t bytes=estimate_run_bytes(opt,PLAN.per_well && WELL_POOL?WELL_POOL->size():1);
+        auto t_queue=std::chrono::steady_clock::now();
+        auto verdict=ADMISSION.acquire(bytes);
+        double queue_ms=elapsed_ms(t_queue);
+        if (verdict!=AdmissionControl::ADMITTED) {
+            const char* why=verdict==AdmissionControl::QUEUE_FULL?"analysis queue full"
+                           :verdict==AdmissionControl::TIMED_OUT?"timed out waiting for an analysis slot"
+                           :"request exceeds the analysis memory budget";
+            res.status=verdict==AdmissionControl::QUEUE_FULL?429:503;
+            if (verdict!=AdmissionControl::TOO_LARGE) res.set_header("Retry-After",std::to_string(ADMISSION.retry_after_s()));
+            res.set_content(std::string("{\"error\":\"")+why+"\"}","application/json");
+            std::cout<<"Rejected analysis: "<<why<<std::endl;
+            return;
+        }
+        QUEUE_TIMES.observe(queue_ms);
+        if (opt.stream) {
+            // Chunked: wells go out as they are analysed. Headers leave first,
+            // so compute_ms closes the object instead of opening it.
+            // The slot is given back when httplib drops the provider, whether
+            // the run completed, failed or the client went away first.
+            struct Slot {
+                size_t bytes;
+                bool started=false;
+                std::chrono::steady_clock::time_point t0;
+                explicit Slot(size_t b) : bytes(b) {}
+                ~Slot() { ADMISSION.release(bytes,started?elapsed_ms(t0):-1); }
+            };
+            auto slot=std::make_shared<Slot>(bytes);
+            res.set_header("Server-Timing","queue;dur="+std::to_string(queue_ms));
+            res.set_chunked_content_provider("application/json",
+                [opt,queue_ms,slot](size_t,httplib::DataSink& sink){
+                    slot->started=true;
+                    slot->t0=std::chrono::steady_clock::now();
+                    bool first=true;
+                    bool ok=analyse_plate(opt,[&](const std::string& part){
+                        if (!first) return sink.write(part.data(),part.size());
+                        first=false;
+                        std::ostringstream head;   // queue_ms after the opening brace
+                        head<<std::fixed<<std::setprecision(1)<<"{\n  \"queue_ms\":"<<queue_ms<<","<<part.substr(1);
+                        return sink.write(head.str().data(),head.str().size());
+                    });
+                    if (!ok) return false;
+                    std::ostringstream tail;
+                    tail<<std::fixed<<std::setprecision(1)<<",\n  \"compute_ms\":"<<elapsed_ms(slot->t0)<<"\n}";
+                    sink.write(tail.str().data(),tail.str().size());
+                    sink.done();
+                    std::cout<<"Complete (streamed)."<<std::endl;
+                    return true;
+                });
+            return;
+        }
+        auto t_compute=std::chrono::steady_clock::now();
+        std::string json;
+        try { json=run_full_analysis(opt); }
+        catch (...) { ADMISSION.release(bytes,elapsed_ms(t_compute)); throw; }
+        double compute_ms=elapsed_ms(t_compute);
+        ADMISSION.release(bytes,compute_ms);
         std::cout<<"Complete."<<std::endl;
+        std::ostringstream timing;   // spliced in after the opening brace
+        timing<<std::fixed<<std::setprecision(1)<<"\n  \"queue_ms\":"<<queue_ms<<",\n  \"compute_ms\":"<<compute_ms<<",";
+        json.insert(1,timing.str());
+        res.set_header("Server-Timing","queue;dur="+std::to_string(queue_ms)+", compute;dur="+std::to_string(compute_ms));
         res.set_content(json,"application/json");
     });
+    // Stored runs of a patient: ?patient=<id>[&since=<unix s>&until=<unix s>&limit=<n>]
+    server.Get("/api/runs",[](const httplib::Request& req,httplib::Response& res){
+        std::string patient=safe_id(req.get_param_value("patient"));
+        if (patient.empty()) { res.status=400; res.set_content("{\"error\":\"patient is required\"}","application/json"); return; }
+        int64_t since=req.has_param("since")?std::atoll(req.get_param_value("since").c_str()):INT64_MIN;
+        int64_t until=req.has_param("until")?std::atoll(req.get_param_value("until").c_str()):INT64_MAX;
+        size_t limit=req.has_param("limit")?std::max(1,std::atoi(req.get_param_value("limit").c_str())):1000;
+        auto runs=STORE.list(patient,since,until,limit);
+        std::ostringstream j;
+        j<<"{\"patient\":\""<<patient<<"\",\"runs\":[";
+        for (size_t k=0;k<runs.size();k++)
+            j<<(k?",":"")<<"{\"run_id\":\""<<runs[k].first<<"\",\"timestamp\":"<<runs[k].second<<"}";
+        j<<"]}";
+        res.set_content(j.str(),"application/json");
+    });
+    // Summary and per-well metrics of a run, from memory or the run store.
+    server.Get(R"(/api/runs/([^/]+))",[](const httplib::Request& req,httplib::Response& res){
+        auto run=RUNS.find(req.matches[1]);
+        std::string summary=run?run->summary:STORE.summary(req.matches[1]);
+        if (summary.empty()) { res.status=404; res.set_content("{\"error\":\"unknown run\"}","application/json"); return; }
+        res.set_content(summary,"application/json");
+    });
+    // Drugs ranked by median efficacy across stored runs: ?cohort=<id> (all cohorts when omitted).
+    server.Get("/api/drugs",[](const httplib::Request& req,httplib::Response& res){
+        auto t0=std::chrono::steady_clock::now();
+        std::vector<std::string> names;
+        for (const auto& d:DRUGS) names.push_back(d.name);
+        std::string cohort=safe_id(req.get_param_value("cohort"));
+        auto stats=EFFICACY.query(names,cohort);
+        std::stable_sort(stats.begin(),stats.end(),[](const DrugStats& a,const DrugStats& b){return a.median>b.median;});
+        std::ostringstream j;
+        j<<std::fixed<<std::setprecision(2)<<"{\"cohort\":\""<<cohort<<"\",\"query_ms\":"<<elapsed_ms(t0)<<",\"drugs\":[";
+        for (size_t k=0;k<stats.size();k++) j<<(k?",":"")<<drug_stats_json(stats[k]);
+        j<<"]}";
+        res.set_content(j.str(),"application/json");
+    });
+    // One drug across stored runs: ?cohort=<id>, and ?run=<id> or ?value=<efficacy> for a percentile rank.
+    server.Get(R"(/api/drugs/([^/]+))",[](const httplib::Request& req,httplib::Response& res){
+        auto t0=std::chrono::steady_clock::now();
+        std::string drug=req.matches[1];
+        if (std::none_of(DRUGS.begin(),DRUGS.end(),[&](const DrugEntry& d){return d.name==drug;})) {
+            res.status=404; res.set_content("{\"error\":\"unknown drug\"}","application/json"); return;
+        }
+        double value=req.has_param("value")?std::atof(req.get_param_value("value").c_str()):-1;
+        if (req.has_param("run")) {
+            auto run=find_run(req.get_param_value("run"));
+            if (run) for (const auto& w:run->wells) if (w.drug==drug) value=w.efficacy;
+        }
+        std::string cohort=safe_id(req.get_param_value("cohort"));
+        auto st=EFFICACY.query({drug},cohort,{value})[0];
+        if (!st.n) { res.status=404; res.set_content("{\"error\":\"no runs for this drug/cohort\"}","application/json"); return; }
+        std::ostringstream j;
+        j<<std::fixed<<std::setprecision(2)<<"{\"cohort\":\""<<cohort<<"\",\"query_ms\":"<<elapsed_ms(t0)
+         <<",\"stats\":"<<drug_stats_json(st)<<"}";
+        res.set_content(j.str(),"application/json");
+    });
+    // Per-cell table of a recent run: columnar binary by default, ?format=csv as fallback.
+    server.Get(R"(/api/runs/([^/]+)/cells)",[](const httplib::Request& req,httplib::Response& res){
+        auto run=find_run(req.matches[1]);
+        if (!run) { res.status=404; res.set_content("{\"error\":\"unknown run\"}","application/json"); return; }
+        if (!run->cells_kept) { res.status=404; res.set_content("{\"error\":\"cells not persisted for this run\"}","application/json"); return; }
+        if (req.get_param_value("format")=="csv") res.set_content(cells_csv(run->cells),"text/csv");
+        else res.set_content(cells_columnar(run->cells),"application/octet-stream");
+    });
+    // Plate overview PNG: ?metric=efficacy|viability, ?thumbs=1 to embed well thumbnails.
+    server.Get(R"(/api/runs/([^/]+)/plate)",[](const httplib::Request& req,httplib::Response& res){
+        auto run=find_run(req.matches[1]);
+        if (!run) { res.status=404; res.set_content("{\"error\":\"unknown run\"}","application/json"); return; }
+        auto png=render_plate(*run,req.get_param_value("metric")=="viability",req.get_param_value("thumbs")=="1");
+        res.set_content(std::string(png.begin(),png.end()),"image/png");
+    });
+    // One pyramid level of a well frame as PNG: ?level=0 full, 1 half, 2 quarter.
+    server.Get(R"(/api/runs/([^/]+)/wells/(\d+)/frame)",[](const httplib::Request& req,httplib::Response& res){
+        auto run=find_run(req.matches[1]);
+        size_t w=std::stoul(req.matches[2]);
+        int level=std::atoi(req.get_param_value("level").c_str());
+        if (!run || w>=run->frames.size() || level<0 || level>=FRAME_LEVELS) {
+            res.status=404; res.set_content("{\"error\":\"unknown run, well or level\"}","application/json"); return;
+        }
+        if (run->frames[w][level].empty()) {   // streamed runs keep no frames
+            res.status=404; res.set_content("{\"error\":\"frame not kept (streamed run)\"}","application/json"); return;
+        }
+        const auto& png=run->frames[w][level];
+        res.set_content(std::string(png.begin(),png.end()),"image/png");
+    });
+    // COCO-RLE masks of one well's cells: {"size":[h,w],"masks":[{"cell":row,"counts":"..."}]}
+    server.Get(R"(/api/runs/([^/]+)/wells/(\d+)/masks)",[](const httplib::Request& req,httplib::Response& res){
+        auto run=find_run(req.matches[1]);
+        size_t w=std::stoul(req.matches[2]);
+        if (!run || w>=run->masks.size()) {
+            res.status=404;
+            res.set_content("{\"error\":\"no masks for this run/well (analyze with masks=1)\"}","application/json");
+            return;
+        }
+        const auto& m=run->masks[w];
+        std::ostringstream j;
+        j<<"{\"run_id\":\""<<run->id<<"\",\"well_index\":"<<w<<",\"size\":["<<m.height<<","<<m.width<<"],\"masks\":[";
+        for (size_t k=0;k<m.rle.size();k++) {
+            j<<(k?",":"")<<"{\"cell\":"<<(m.first_cell+k)<<",\"counts\":\"";
+            for (char c:m.rle[k]) { if (c=='\\') j<<'\\'; j<<c; }   // the RLE alphabet includes a backslash
+            j<<"\"}";
+        }
+        j<<"]}";
+        res.set_content(j.str(),"application/json");
+    });
+    // Parameter set new runs will use (see ANALYZER_CONFIG).
+    server.Get("/api/params",[](const httplib::Request&,httplib::Response& res){
+        auto prm=current_params();
+        const auto& b=prm->blob;
+        std::ostringstream j;
+        j<<"{\"version\":"<<prm->version<<",\"live_mean_threshold\":"<<prm->live_mean_threshold
+         <<",\"classifier_model\":\""<<(prm->model.loaded?prm->model_path:"")<<"\",\"blob\":{"
+         <<"\"min_threshold\":"<<b.minThreshold<<",\"max_threshold\":"<<b.maxThreshold
+         <<",\"threshold_step\":"<<b.thresholdStep<<",\"min_dist\":"<<b.minDistBetweenBlobs
+         <<",\"min_area\":"<<b.minArea<<",\"max_area\":"<<b.maxArea
+         <<",\"min_circularity\":"<<b.minCircularity<<",\"min_convexity\":"<<b.minConvexity
+         <<",\"min_inertia\":"<<b.minInertiaRatio<<"}}";
+        res.set_content(j.str(),"application/json");
+    });
+    server.Get("/metrics",[](const httplib::Request&,httplib::Response& res){
+        res.set_content(metrics_text(),"text/plain; version=0.0.4");
+    });
     server.Get("/api/status",[](const httplib::Request&,httplib::Response& res){
-        res.set_content("{\"status\":\"active\",\"wells\":20}","application/json");
+        res.set_content(std::string("{\"status\":\"")+(READY?"active":"warming")+"\",\"wells\":20}","application/json");
+    });
+    // 200 once warmed up, 503 before: polled by the app's Docker launcher and
+    // the image's HEALTHCHECK (cell_analyzer --health).
+    server.Get("/api/ready",[](const httplib::Request&,httplib::Response& res){
+        if (READY) { res.set_content("{\"ready\":true}","application/json"); return; }
+        res.status=503;
+        res.set_header("Retry-After","1");
+        res.set_content("{\"ready\":false,\"status\":\"warming\"}","application/json");
     });
 
     // Handle CORS preflight
@@ -207,6 +3401,10 @@ int main() {
     if (std::getenv("PORT")) {
         port = std::stoi(std::getenv("PORT"));
     }
+    std::thread warming;
+    if (env_int("ANALYZER_WARMUP",1)) warming=std::thread(warm_up);
+    else READY=true;
     server.listen("0.0.0.0", port);
+    if (warming.joinable()) warming.join();
     return 0;
 }
@@ -3441,18 +3441,66 @@ class WellData {
   final int wellIndex, totalCells, aliveCells, deadCells;
   final String drug, category, framePng;
   final double viability, efficacy;
+  // Vector overlay (analyze?overlay=vector): framePng is then the raw grayscale
+  // frame and the client draws these circles [x, y, r, alive] and captions.
+  final Size? frameSize;
+  final List<List<double>> overlayCells;
+  final List<String> overlayLabels;
   const WellData({required this.wellIndex, required this.totalCells,
     required this.aliveCells, required this.deadCells, required this.drug,
     required this.category, required this.framePng, required this.viability,
-    required this.efficacy});
-  factory WellData.fromJson(Map<String, dynamic> j) => WellData(
-    wellIndex: j['well_index'], totalCells: j['total_cells'],
-    aliveCells: j['alive_cells'], deadCells: j['dead_cells'],
-    drug: j['drug'], category: j['category'],
-    viability: (j['viability'] as num).toDouble(),
-    efficacy: (j['efficacy'] as num).toDouble(),
-    framePng: j['frame_b64'] ?? '',
-  );
+    required this.efficacy, this.frameSize, this.overlayCells = const [],
+    this.overlayLabels = const []});
+  factory WellData.fromJson(Map<String, dynamic> j) {
+    final o = j['overlay'] as Map<String, dynamic>?;
+    return WellData(
+      wellIndex: j['well_index'], totalCells: j['total_cells'],
+      aliveCells: j['alive_cells'], deadCells: j['dead_cells'],
+      drug: j['drug'], category: j['category'],
+      viability: (j['viability'] as num).toDouble(),
+      efficacy: (j['efficacy'] as num).toDouble(),
+      framePng: j['frame_b64'] ?? '',
+      frameSize: o == null ? null
+          : Size((o['width'] as num).toDouble(), (o['height'] as num).toDouble()),
+      overlayCells: o == null ? const [] : (o['cells'] as List)
+          .map((c) => (c as List).map((v) => (v as num).toDouble()).toList()).toList(),
+      overlayLabels: o == null ? const [] : List<String>.from(o['labels'] as List),
+    );
+  }
+}
+
+// Draws a well's vector overlay over a frame shown with BoxFit.contain.
+class _WellOverlayPainter extends CustomPainter {
+  final Size frame;
+  final List<List<double>> cells;
+  final List<String> labels;
+  const _WellOverlayPainter(this.frame, this.cells, this.labels);
+
+  @override
+  void paint(Canvas canvas, Size size) {
+    final sx = size.width / frame.width, sy = size.height / frame.height;
+    final s = sx < sy ? sx : sy;
+    final dx = (size.width - frame.width * s) / 2, dy = (size.height - frame.height * s) / 2;
+    final alive = Paint()..style = PaintingStyle.stroke..strokeWidth = 2
+        ..color = const Color(0xFF3CC83C);
+    final dead = Paint()..style = PaintingStyle.stroke..strokeWidth = 2
+        ..color = const Color(0xFFDC3C3C);
+    for (final c in cells) {
+      canvas.drawCircle(Offset(dx + c[0] * s, dy + c[1] * s), c[2] * s, c[3] > 0 ? alive : dead);
+    }
+    for (var i = 0; i < labels.length && i < 2; i++) {
+      final tp = TextPainter(
+        text: TextSpan(text: labels[i], style: TextStyle(fontSize: 11,
+            color: i == 0 ? const Color(0xFFC8C8C8) : const Color(0xFF64DC64))),
+        textDirection: TextDirection.ltr)..layout();
+      tp.paint(canvas, Offset(dx + 4 * s,
+          i == 0 ? dy + 4 * s : dy + frame.height * s - tp.height - 4 * s));
+    }
+  }
+
+  @override
+  bool shouldRepaint(_WellOverlayPainter old) =>
+      old.frame != frame || old.cells != cells || old.labels != labels;
 }
 
 class RankedEntry {
@@ -3500,7 +3548,8 @@ class _OncologyPanelState extends State<OncologyPanel> {
   bool _exportingReport = false;
   String _status = 'Idle';
   int? _selectedWell;
-  final String _url = '${_BackendConfig.cellUrl}/api/analyze';
+  String get _url => '${_BackendConfig.cellUrl}/api/analyze?overlay=vector'
+      '&patient=${Uri.encodeQueryComponent(widget.patient['id'] ?? '')}';
 
   @override
   void initState() { super.initState(); if (widget.unlocked) _analyze(); }
@@ -3539,6 +3588,12 @@ class _OncologyPanelState extends State<OncologyPanel> {
           wellCount:    (d['wells'] as List).length,
           timestamp:    DateTime.now(),
         ));
+      } else if (r.statusCode == 429 || r.statusCode == 503) {
+        final retry = r.headers['retry-after'];
+        setState(() {
+          _status  = retry != null ? 'Server busy — retry in ${retry}s' : 'Server busy';
+          _loading = false;
+        });
       }
     } catch (e) {
       if (!mounted) return;
@@ -3841,6 +3896,8 @@ class _OncologyPanelState extends State<OncologyPanel> {
                 w.framePng.isNotEmpty
                     ? Image.memory(base64Decode(w.framePng), fit: BoxFit.contain)
                     : const Center(child: CircularProgressIndicator()),
+                if (w.frameSize != null)
+                  CustomPaint(painter: _WellOverlayPainter(w.frameSize!, w.overlayCells, w.overlayLabels)),
                 Positioned(top: 0, left: 0, right: 0,
                   child: Container(
                     padding: const EdgeInsets.symmetric(horizontal: 16, vertical: 10),
@@ -3881,7 +3938,7 @@ class _OncologyPanelState extends State<OncologyPanel> {
                         const Text('Alive', style: TextStyle(fontSize: 10, color: Colors.white70)),
                         const SizedBox(width: 10),
                         Container(width: 8, height: 8, decoration: const BoxDecoration(
-                            color: Color(0xFF3C3CDC), shape: BoxShape.circle)),
+                            color: Color(0xFFDC3C3C), shape: BoxShape.circle)),
                         const SizedBox(width: 4),
                         const Text('Dead', style: TextStyle(fontSize: 10, color: Colors.white70)),
                       ]),
@@ -5768,6 +5825,8 @@ Map<String, Map<String, dynamic>> get _imageConfig => {
     'port': 8081,
     'context': '$_projectRoot/backend',
     'dockerfile': '$_projectRoot/backend/Dockerfile.cell',
+    'volume': 'cell-runs:/app/runs',   // run store survives container restarts
+    'ready': '/api/ready',             // 503 until the analyzer has warmed up
   },
 };
 
@@ -5783,6 +5842,8 @@ Future<void> launchDocker(
       port: port,
       contextPath:    cfg['context']    as String? ?? '$_projectRoot/backend',
       dockerfilePath: cfg['dockerfile'] as String? ?? '${cfg['context']}/Dockerfile',
+      volume:         cfg['volume']     as String?,
+      readyPath:      cfg['ready']      as String?,
     ),
   );
 }
@@ -5793,18 +5854,22 @@ class _DockerProgressDialog extends StatefulWidget {
   final int port;
   final String contextPath;
   final String dockerfilePath;
+  final String? volume;
+  final String? readyPath;   // polled after start until it answers 200
   const _DockerProgressDialog({
     required this.image,
     required this.port,
     required this.contextPath,
     required this.dockerfilePath,
+    this.volume,
+    this.readyPath,
   });
   @override
   State<_DockerProgressDialog> createState() => _DockerProgressDialogState();
 }
 
 class _DockerProgressDialogState extends State<_DockerProgressDialog> {
-  // Phases: checking → building → starting → done / error
+  // Phases: checking → building → starting → warming → done / error
   String _phase   = 'checking';
   bool   _success = false;
   bool   _done    = false;
@@ -5912,13 +5977,18 @@ class _DockerProgressDialogState extends State<_DockerProgressDialog> {
       final run = await Process.run(
         '/bin/sh',
         ['-c', '$docker run -d --name ${widget.image} '
-               '-p ${widget.port}:${widget.port} ${widget.image}'],
+               '-p ${widget.port}:${widget.port} '
+               '${widget.volume != null ? '-v ${widget.volume} ' : ''}${widget.image}'],
         environment: env,
       );
 
       if (run.exitCode == 0) {
         final id = run.stdout.toString().trim().substring(0, 12);
         _log('✓  Container started  (id: $id)');
+        if (widget.readyPath != null && !await _waitReady(widget.readyPath!)) {
+          setState(() { _phase = 'error'; _done = true; });
+          return;
+        }
         _log('');
         _log('Listening on http://localhost:${widget.port}');
         setState(() { _phase = 'done'; _success = true; _done = true; });
@@ -5936,6 +6006,29 @@ class _DockerProgressDialogState extends State<_DockerProgressDialog> {
     }
   }
 
+  // ── 5. Wait for the service to finish warming up ──────────────────────
+  Future<bool> _waitReady(String path) async {
+    setState(() => _phase = 'warming');
+    _log('▶ Waiting for $path…');
+    final url = Uri.parse('http://localhost:${widget.port}$path');
+    final deadline = DateTime.now().add(const Duration(seconds: 120));
+    while (DateTime.now().isBefore(deadline)) {
+      if (!mounted) return false;
+      try {
+        final r = await http.get(url).timeout(const Duration(seconds: 2));
+        if (r.statusCode == 200) {
+          _log('✓  Ready.');
+          return true;
+        }
+      } catch (_) {
+        // not listening yet
+      }
+      await Future.delayed(const Duration(milliseconds: 500));
+    }
+    _log('✗  Not ready after 120 s — check "docker logs ${widget.image}".');
+    return false;
+  }
+
   @override
   void dispose() {
     _scroll.dispose();
@@ -5948,6 +6041,7 @@ class _DockerProgressDialogState extends State<_DockerProgressDialog> {
       'checking'  => ('Checking image',   const Color(0xFF9E9E9E)),
       'building'  => ('Building image',   (themeNotifier.dark ? AppColors.darkPrimary : Color(0xFF388BFF))),
       'starting'  => ('Starting container', (themeNotifier.dark ? AppColors.darkPrimary : Color(0xFF388BFF))),
+      'warming'   => ('Warming up',       (themeNotifier.dark ? AppColors.darkPrimary : Color(0xFF388BFF))),
       'done'      => ('Running',           const Color(0xFF26C6A0)),
       _           => ('Error',             const Color(0xFFEF5350)),
     };